@@ -1,6 +1,8 @@
 package dpdkflow
 
 // #cgo pkg-config: libdpdk
+// #cgo CFLAGS: -DALLOW_EXPERIMENTAL_API
+// #cgo LDFLAGS: -lz -lbz2
 // #include <rte_config.h>
 // #include <rte_eal.h>
 // #include <rte_ethdev.h>
@@ -12,8 +14,13 @@ package dpdkflow
 import "C"
 
 import (
+	"bytes"
 	"fmt"
+	"math/bits"
 	"net"
+	"net/url"
+	"strconv"
+	"strings"
 	"time"
 	"unsafe"
 
@@ -26,6 +33,7 @@ type DpdkFlowPort struct {
 	Description string `toml:"description"`
 	PortVlanId  int    `toml:"port_vlan_id"`
 	TagVlanIds  []int  `toml:"tag_vlan_ids"`
+	Queues      []int  `toml:"queues"`
 }
 
 type DpdkFlowCore struct {
@@ -34,26 +42,67 @@ type DpdkFlowCore struct {
 }
 
 type DpdkFlow struct {
-	MainCoreIndex     int            `toml:"main_core_index"`
-	Interval          int            `toml:"interval"`
-	MetricsNum        uint32         `toml:"metrics_num"`
-	ThreshPackets     uint32         `toml:"thresh_packets"`
-	ThreshBytes       uint32         `toml:"thresh_bytes"`
-	LocalNetsIpv4     []string       `toml:"local_nets_ipv4"`
-	LocalNetsIpv6     []string       `toml:"local_nets_ipv6"`
-	AggregateIncoming []string       `toml:"aggregate_incoming"`
-	AggregateOutgoing []string       `toml:"aggregate_outgoing"`
-	AggregateInternal []string       `toml:"aggregate_internal"`
-	AggregateExternal []string       `toml:"aggregate_external"`
-	MrtRibPath        string         `toml:"mrt_rib_path"`
-	Cores             []DpdkFlowCore `toml:"core"`
-
-	acc telegraf.Accumulator
-	ctx *C.struct_dpdkflow_context
+	MainCoreIndex       int            `toml:"main_core_index"`
+	Interval            int            `toml:"interval"`
+	IntervalAlign       bool           `toml:"interval_align"`
+	MetricsNum          uint32         `toml:"metrics_num"`
+	ThreshPackets       uint32         `toml:"thresh_packets"`
+	ThreshBytes         uint32         `toml:"thresh_bytes"`
+	TopK                uint32         `toml:"topk"`
+	AdaptiveAggregation bool           `toml:"adaptive_aggregation"`
+	RxBurstSize         uint16         `toml:"rx_burst_size"`
+	LocalNetsIpv4       []string       `toml:"local_nets_ipv4"`
+	LocalNetsIpv6       []string       `toml:"local_nets_ipv6"`
+	AggregateIncoming   []string       `toml:"aggregate_incoming"`
+	AggregateOutgoing   []string       `toml:"aggregate_outgoing"`
+	AggregateInternal   []string       `toml:"aggregate_internal"`
+	AggregateExternal   []string       `toml:"aggregate_external"`
+	MrtRibPath          string         `toml:"mrt_rib_path"`
+	MrtUpdateDir        string         `toml:"mrt_update_dir"`
+	MrtPeers            []string       `toml:"mrt_peers"`
+	CheckpointPath      string         `toml:"checkpoint_path"`
+	EalArgs             []string       `toml:"eal_args"`
+	IpfixExport         string         `toml:"ipfix_export"`
+	IpfixMtu            uint16         `toml:"ipfix_mtu"`
+	IpfixDomainId       uint32         `toml:"ipfix_domain_id"`
+	Cores               []DpdkFlowCore `toml:"core"`
+
+	acc     telegraf.Accumulator
+	ctx     *C.struct_dpdkflow_context
+	stopped chan struct{}
+
+	tagSchemas   [directionNum][degradeLevels]tagSchema
+	tags         [directionNum][degradeLevels]map[string]string
+	overflowTags map[string]string
+	fields       map[string]interface{}
+	tagCache     *tagCache
 }
 
 var globalDf *DpdkFlow
 
+// 配列の大きさに使うので、 C の変数(degrade_max など)ではなくマクロから定数として取る。
+const (
+	directionNum = C.DIRECTION_NUM
+	// adaptive_aggregation の段階の数
+	degradeLevels = C.DEGRADE_MAX + 1
+	degradePorts  = C.DEGRADE_PORTS
+	degradeNoHost = C.DEGRADE_NO_HOST
+)
+
+var (
+	aggregateFIface   = uint32(C.aggregate_f_iface)
+	aggregateFAf      = uint32(C.aggregate_f_af)
+	aggregateFProto   = uint32(C.aggregate_f_proto)
+	aggregateFVlan    = uint32(C.aggregate_f_vlan)
+	aggregateFSrcHost = uint32(C.aggregate_f_src_host)
+	aggregateFDstHost = uint32(C.aggregate_f_dst_host)
+	aggregateFSrcAs   = uint32(C.aggregate_f_src_as)
+	aggregateFDstAs   = uint32(C.aggregate_f_dst_as)
+	aggregateFSrcPort = uint32(C.aggregate_f_src_port)
+	aggregateFDstPort = uint32(C.aggregate_f_dst_port)
+	aggregateFApp     = uint32(C.aggregate_f_app)
+)
+
 func NewDpdkFlow() *DpdkFlow {
 	df := &DpdkFlow{}
 	if globalDf == nil {
@@ -62,19 +111,6 @@ func NewDpdkFlow() *DpdkFlow {
 	return df
 }
 
-func ifaceStr(iface int8) string {
-	if globalDf != nil {
-		for _, c := range globalDf.Cores {
-			for _, p := range c.Ports {
-				if p.Index == int(iface) {
-					return p.Description
-				}
-			}
-		}
-	}
-	return "unknown"
-}
-
 func directionStr(direction int8) string {
 	switch direction {
 	case int8(C.direction_incoming):
@@ -99,30 +135,79 @@ func afStr(af uint8) string {
 	return "unknown"
 }
 
-func hostStr(host unsafe.Pointer) string {
-	var hostStr string
-	ba := (*[16]byte)(host)
-	if ba[0] == 0 && ba[1] == 0 && ba[2] == 0 && ba[3] == 0 &&
-		ba[4] == 0 && ba[5] == 0 && ba[6] == 0 && ba[7] == 0 &&
-		ba[8] == 0 && ba[9] == 0 && ba[10] == 0 && ba[11] == 0 {
-		/* IPv4 */
-		hostStr = net.IPv4(ba[12], ba[13], ba[14], ba[15]).String()
+func boolToInt(b bool) int {
+	if b {
+		return 1
+	}
+	return 0
+}
+
+func portQueues(p DpdkFlowPort) []int {
+	if len(p.Queues) == 0 {
+		return []int{0}
+	}
+	return p.Queues
+}
+
+// "src_host/24" や "dst_host/24/48" のようにホストにプレフィクス長を付けられる。
+// 長さが 1 つのときは 32 以下なら IPv4 、それより大きければ IPv6 のプレフィクス長とする。
+func hostPrefixLens(aggr string) (string, [2]uint8, error) {
+	plens := [2]uint8{32, 128}
+	parts := strings.Split(aggr, "/")
+	if len(parts) == 1 {
+		return aggr, plens, nil
+	}
+	if (parts[0] != "src_host" && parts[0] != "dst_host") || len(parts) > 3 {
+		return "", plens, fmt.Errorf("hostPrefixLens: invalid aggregate: %s", aggr)
+	}
+	lens := make([]int, 0, 2)
+	for _, p := range parts[1:] {
+		n, err := strconv.Atoi(p)
+		if err != nil || n < 0 || n > 128 {
+			return "", plens, fmt.Errorf("hostPrefixLens: invalid prefix length: %s", aggr)
+		}
+		lens = append(lens, n)
+	}
+	if len(lens) == 2 {
+		if lens[0] > 32 {
+			return "", plens, fmt.Errorf("hostPrefixLens: invalid ipv4 prefix length: %s", aggr)
+		}
+		plens[0] = uint8(lens[0])
+		plens[1] = uint8(lens[1])
+	} else if lens[0] <= 32 {
+		plens[0] = uint8(lens[0])
 	} else {
-		/* IPv6 */
-		hostStr = net.IP{
-			ba[0], ba[1], ba[2], ba[3],
-			ba[4], ba[5], ba[6], ba[7],
-			ba[8], ba[9], ba[10], ba[11],
-			ba[12], ba[13], ba[14], ba[15],
-		}.String()
-	}
-	return hostStr
+		plens[1] = uint8(lens[0])
+	}
+	return parts[0], plens, nil
+}
+
+// [src_host, dst_host][IPv4, IPv6] のプレフィクス長
+func aggregateHostPrefixLens(aggregate []string) [2][2]uint8 {
+	plens := [2][2]uint8{{32, 128}, {32, 128}}
+	for _, aggr := range aggregate {
+		name, p, err := hostPrefixLens(aggr)
+		if err != nil {
+			continue
+		}
+		switch name {
+		case "src_host":
+			plens[0] = p
+		case "dst_host":
+			plens[1] = p
+		}
+	}
+	return plens
 }
 
 func aggregateFlags(aggregate []string) (uint32, error) {
 	var flags uint32
 	for _, aggr := range aggregate {
-		switch aggr {
+		name, _, err := hostPrefixLens(aggr)
+		if err != nil {
+			return 0, err
+		}
+		switch name {
 		case "iface":
 			flags |= uint32(C.aggregate_f_iface)
 		case "af":
@@ -152,71 +237,124 @@ func aggregateFlags(aggregate []string) (uint32, error) {
 	return flags, nil
 }
 
-//export gather
-func gather(d *C.struct_dpdkflow_metric) int {
-	/*
-		tags := map[string]string{
-			"iface":     ifaceStr(int8(d.iface)),
-			"direction": directionStr(int8(d.direction)),
-			"af":        afStr(uint8(d.af)),
-			"proto":     fmt.Sprint(uint8(d.proto)),
-			"vlan":      fmt.Sprint(int32(d.vlan)),
-			"src_host":  hostStr(unsafe.Pointer(&d.src_host[0])),
-			"dst_host":  hostStr(unsafe.Pointer(&d.dst_host[0])),
-			"src_as":    fmt.Sprint(int64(d.src_as)),
-			"dst_as":    fmt.Sprint(int64(d.dst_as)),
-			"src_port":  fmt.Sprint(int(d.src_port)),
-			"dst_port":  fmt.Sprint(int(d.dst_port)),
-			"app":       fmt.Sprintf("%08x", uint32(d.app)),
-			"app_desc":  C.GoString(&d.app_desc[0]),
-		}
-	*/
+//export gather_batch
+func gather_batch(batch *C.struct_dpdkflow_metric, n C.int, tm C.uint64_t) int {
 	if globalDf == nil {
 		return 0
 	}
-	tags := map[string]string{
-		"direction": directionStr(int8(d.direction)),
+	var now time.Time
+	if tm != 0 {
+		now = time.UnixMicro(int64(tm))
+	} else {
+		now = time.Now()
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_iface) == 1 {
-		tags["iface"] = ifaceStr(int8(d.iface))
+	globalDf.tagCache.trim()
+	records := unsafe.Slice(batch, int(n))
+	for i := range records {
+		gather(&records[i], now)
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_af) == 1 {
-		tags["af"] = afStr(uint8(d.af))
+	return 0
+}
+
+// TSC から壁時計への変換。 C の clock_tsc_to_usec と同じ計算をする。
+type clockMapping struct {
+	tscBase  uint64
+	usecBase uint64
+	mult     uint64
+}
+
+// lcore_main が較正した最新の変換を写し取る。
+func (df *DpdkFlow) clockMapping() clockMapping {
+	var tscBase, usecBase, mult C.uint64_t
+	C.clock_snapshot(df.ctx, &tscBase, &usecBase, &mult)
+	return clockMapping{tscBase: uint64(tscBase), usecBase: uint64(usecBase), mult: uint64(mult)}
+}
+
+func (m clockMapping) usec(tsc uint64) uint64 {
+	if tsc < m.tscBase {
+		return m.usecBase
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_proto) == 1 {
-		tags["proto"] = fmt.Sprint(uint8(d.proto))
+	hi, lo := bits.Mul64(tsc-m.tscBase, m.mult)
+	return m.usecBase + (hi<<32 | lo>>32)
+}
+
+func (m clockMapping) time(tsc uint64) time.Time {
+	return time.UnixMicro(int64(m.usec(tsc)))
+}
+
+func gather(d *C.struct_dpdkflow_metric, tm time.Time) {
+	df := globalDf
+	c := df.tagCache
+	direction := int8(d.key.direction)
+	if direction < 0 || int(direction) >= len(df.tagSchemas) {
+		direction = 0
+	}
+	/* 方向ごとに出すタグの組は決まっているので、マップは毎回上書きして使い回す。 */
+	degrade := int(d.key.degrade)
+	if degrade >= degradeLevels {
+		degrade = degradeLevels - 1
+	}
+	s := &df.tagSchemas[direction][degrade]
+	tags := df.tags[direction][degrade]
+	if d.key.overflow != 0 {
+		/* あふれ用のメトリックは方向と AF とポートだけで集約している。 */
+		tags = df.overflowTags
+		for k := range tags {
+			delete(tags, k)
+		}
+		tags["overflow"] = "true"
+		s = &tagSchema{iface: s.iface, af: s.af}
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_vlan) == 1 {
-		tags["vlan"] = fmt.Sprint(int32(d.vlan))
+	tags["direction"] = directionStr(direction)
+	if df.AdaptiveAggregation {
+		tags["degrade"] = c.degrade(degrade)
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_src_host) == 1 {
-		tags["src_host"] = hostStr(unsafe.Pointer(&d.src_host[0]))
+	if s.iface {
+		tags["iface"] = c.iface(int8(d.key.iface))
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_dst_host) == 1 {
-		tags["dst_host"] = hostStr(unsafe.Pointer(&d.dst_host[0]))
+	if s.af {
+		tags["af"] = afStr(uint8(d.key.af))
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_src_as) == 1 {
-		tags["src_as"] = fmt.Sprint(int64(d.src_as))
+	if s.proto {
+		tags["proto"] = c.proto(uint8(d.key.proto))
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_dst_as) == 1 {
-		tags["dst_as"] = fmt.Sprint(int64(d.dst_as))
+	if s.vlan {
+		tags["vlan"] = c.vlan(int32(d.key.vlan))
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_src_port) == 1 {
-		tags["src_port"] = fmt.Sprint(int(d.src_port))
+	if s.srcHost {
+		tags["src_host"] = c.host((*[16]byte)(unsafe.Pointer(&d.key.src_host[0])))
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_dst_port) == 1 {
-		tags["dst_port"] = fmt.Sprint(int(d.dst_port))
+	if s.dstHost {
+		tags["dst_host"] = c.host((*[16]byte)(unsafe.Pointer(&d.key.dst_host[0])))
 	}
-	if C.aggregate_flag_up(globalDf.ctx, d.direction, C.aggregate_f_app) == 1 {
-		tags["app"] = fmt.Sprintf("%08x", uint32(d.app))
-		tags["app_desc"] = C.GoString(&d.app_desc[0])
+	if s.srcAs {
+		tags["src_as"] = c.asn(uint32(d.key.src_as))
 	}
-	fields := map[string]interface{}{
-		"packets": uint64(d.packets),
-		"bytes":   uint64(d.bytes),
+	if s.dstAs {
+		tags["dst_as"] = c.asn(uint32(d.key.dst_as))
 	}
-	globalDf.acc.AddGauge("dpdkflow", fields, tags, time.Now())
-	return 0
+	if s.srcPort {
+		tags["src_port"] = c.port(int32(d.key.src_port))
+	}
+	if s.dstPort {
+		tags["dst_port"] = c.port(int32(d.key.dst_port))
+	}
+	if s.app {
+		desc := (*[C.APP_DESC_LEN]byte)(unsafe.Pointer(&d.app_desc[0]))[:]
+		if i := bytes.IndexByte(desc, 0); i >= 0 {
+			desc = desc[:i]
+		}
+		tags["app"] = c.app(uint32(d.key.app))
+		tags["app_desc"] = c.appDesc(uint32(d.key.app), desc)
+	}
+	fields := df.fields
+	fields["packets"] = uint64(d.packets)
+	fields["bytes"] = uint64(d.bytes)
+	if df.TopK > 0 {
+		fields["packets_error"] = uint64(d.packets_error)
+		fields["bytes_error"] = uint64(d.bytes_error)
+	}
+	df.acc.AddGauge("dpdkflow", fields, tags, tm)
 }
 
 const sampleConfig = `
@@ -225,12 +363,20 @@ const sampleConfig = `
   ##
   # interval = 300
   ##
+  # interval_align = false
+  ##
   # metrics_num = 65536
   ##
   # thresh_packets = 10
   ##
   # thresh_bytes = 600
   ##
+  # topk = 0
+  ##
+  # adaptive_aggregation = false
+  ##
+  # rx_burst_size = 32
+  ##
   # local_nets_ipv4 = ["192.168.1.0/24", 172.16.1.0/24]
   ##
   # local_nets_ipv6 = ["2001:db8:1::/48"]
@@ -245,6 +391,20 @@ const sampleConfig = `
   ##
   # mrt_rib_path = "/opt/dpdkflow/db/mrt_rib"
   ##
+  # mrt_update_dir = "/opt/dpdkflow/db/mrt_updates"
+  ##
+  # mrt_peers = ["192.0.2.1", "2001:db8::1"]
+  ##
+  # checkpoint_path = "/var/lib/dpdkflow/checkpoint"
+  ##
+  # eal_args = ["--vdev=net_ring0"]
+  ##
+  # ipfix_export = "udp://192.0.2.1:4739"
+  ##
+  # ipfix_mtu = 1400
+  ##
+  # ipfix_domain_id = 0
+  ##
   [[inputs.dpdkflow.core]]
     ##
     # index = 3
@@ -258,6 +418,8 @@ const sampleConfig = `
       # port_vlan_id = 1
       ##
       # tag_vlan_ids = [2, 3]
+      ##
+      # queues = [0]
 `
 
 func (df *DpdkFlow) SampleConfig() string {
@@ -290,9 +452,49 @@ func (df *DpdkFlow) Init() error {
 			df.MetricsNum = t
 		}
 	}
+	if df.RxBurstSize == 0 {
+		fmt.Println("Set RxBurstSize to 32")
+		df.RxBurstSize = 32
+	}
+	if df.RxBurstSize > uint16(C.burst_max) {
+		return fmt.Errorf("rx_burst_size too big")
+	}
+	if df.TopK > 1<<20 {
+		return fmt.Errorf("topk too big")
+	}
 	if len(df.MrtRibPath) > 255 {
 		return fmt.Errorf("mrt_rib_path too long")
 	}
+	if len(df.MrtUpdateDir) > 255 {
+		return fmt.Errorf("mrt_update_dir too long")
+	}
+	if _, _, err := mrtPeers(df.MrtPeers); err != nil {
+		return err
+	}
+	if df.MrtUpdateDir != "" && len(df.MrtPeers) == 0 {
+		return fmt.Errorf("mrt_update_dir needs mrt_peers")
+	}
+	if len(df.CheckpointPath) > 251 {
+		return fmt.Errorf("checkpoint_path too long")
+	}
+	if df.IpfixMtu == 0 {
+		fmt.Println("Set IpfixMtu to 1400")
+		df.IpfixMtu = 1400
+	}
+	if df.IpfixMtu < 512 || df.IpfixMtu > uint16(C.IPFIX_MTU_MAX) {
+		return fmt.Errorf("ipfix_mtu %d out of range", df.IpfixMtu)
+	}
+	if _, err := ipfixTarget(df.IpfixExport); err != nil {
+		return err
+	}
+	if len(df.EalArgs) > int(C.eal_args_max) {
+		return fmt.Errorf("eal_args too many")
+	}
+	for _, a := range df.EalArgs {
+		if len(a) >= int(C.eal_arg_len) {
+			return fmt.Errorf("eal_args %s too long", a)
+		}
+	}
 	if len(df.Cores) > int(C.core_max) {
 		return fmt.Errorf("core too many")
 	}
@@ -304,6 +506,9 @@ func (df *DpdkFlow) Init() error {
 			if len(p.TagVlanIds) > int(C.vlan_max) {
 				return fmt.Errorf("core", c.Index, "port", p.Index, "vlan too many")
 			}
+			if len(p.Queues) > int(C.queue_max) {
+				return fmt.Errorf("core %d port %d queue too many", c.Index, p.Index)
+			}
 		}
 	}
 	coresMap := make(map[int]bool)
@@ -316,13 +521,38 @@ func (df *DpdkFlow) Init() error {
 	if _, ok := coresMap[df.MainCoreIndex]; ok {
 		return fmt.Errorf("core index %d dup", df.MainCoreIndex)
 	}
-	portsMap := make(map[int]bool)
+	portsMap := make(map[int]DpdkFlowPort)
+	queuesMap := make(map[int]map[int]bool)
 	for _, c := range df.Cores {
 		for _, p := range c.Ports {
-			if _, ok := portsMap[p.Index]; ok {
-				return fmt.Errorf("port index %d dup", p.Index)
+			if p.Index < 0 || p.Index >= int(C.port_max) {
+				return fmt.Errorf("port index %d out of range", p.Index)
+			}
+			if q, ok := portsMap[p.Index]; ok {
+				if q.Description != p.Description || q.PortVlanId != p.PortVlanId {
+					return fmt.Errorf("port index %d config mismatch", p.Index)
+				}
+			}
+			portsMap[p.Index] = p
+			if _, ok := queuesMap[p.Index]; !ok {
+				queuesMap[p.Index] = make(map[int]bool)
+			}
+			for _, q := range portQueues(p) {
+				if q < 0 || q >= int(C.queue_max) {
+					return fmt.Errorf("port index %d queue %d out of range", p.Index, q)
+				}
+				if _, ok := queuesMap[p.Index][q]; ok {
+					return fmt.Errorf("port index %d queue %d dup", p.Index, q)
+				}
+				queuesMap[p.Index][q] = true
+			}
+		}
+	}
+	for index, queues := range queuesMap {
+		for q := 0; q < len(queues); q++ {
+			if _, ok := queues[q]; !ok {
+				return fmt.Errorf("port index %d queue %d not assigned", index, q)
 			}
-			portsMap[p.Index] = true
 		}
 	}
 	var err error
@@ -353,9 +583,13 @@ func (df *DpdkFlow) Start(acc telegraf.Accumulator) error {
 	fmt.Println("DpdkFlow.Start()")
 	fmt.Println("MainCoreIndex: ", df.MainCoreIndex)
 	fmt.Println("Interval: ", df.Interval)
+	fmt.Println("IntervalAlign: ", df.IntervalAlign)
 	fmt.Println("MetricsNum: ", df.MetricsNum)
 	fmt.Println("ThreshPackets: ", df.ThreshPackets)
 	fmt.Println("ThreshBytes: ", df.ThreshBytes)
+	fmt.Println("TopK: ", df.TopK)
+	fmt.Println("AdaptiveAggregation: ", df.AdaptiveAggregation)
+	fmt.Println("RxBurstSize: ", df.RxBurstSize)
 	fmt.Println("LocalNetsIpv4: ", df.LocalNetsIpv4)
 	fmt.Println("LocalNetsIpv6: ", df.LocalNetsIpv6)
 	fmt.Println("AggregateIncoming: ", df.AggregateIncoming)
@@ -363,6 +597,13 @@ func (df *DpdkFlow) Start(acc telegraf.Accumulator) error {
 	fmt.Println("AggregateInternal: ", df.AggregateInternal)
 	fmt.Println("AggregateExternal: ", df.AggregateExternal)
 	fmt.Println("MrtRibPath: ", df.MrtRibPath)
+	fmt.Println("MrtUpdateDir: ", df.MrtUpdateDir)
+	fmt.Println("MrtPeers: ", df.MrtPeers)
+	fmt.Println("CheckpointPath: ", df.CheckpointPath)
+	fmt.Println("EalArgs: ", df.EalArgs)
+	fmt.Println("IpfixExport: ", df.IpfixExport)
+	fmt.Println("IpfixMtu: ", df.IpfixMtu)
+	fmt.Println("IpfixDomainId: ", df.IpfixDomainId)
 	for i, c := range df.Cores {
 		fmt.Println("Core", i, ":", c.Index)
 		for j, p := range c.Ports {
@@ -370,19 +611,26 @@ func (df *DpdkFlow) Start(acc telegraf.Accumulator) error {
 			fmt.Println("Description: ", p.Description)
 			fmt.Println("PortVlanId: ", p.PortVlanId)
 			fmt.Println("TagVlanIds: ", p.TagVlanIds)
+			fmt.Println("Queues: ", portQueues(p))
 		}
 	}
 
 	df.acc = acc
 
 	df.ctx = &C.struct_dpdkflow_context{
-		done:            0,
-		running:         0,
-		main_core_index: C.int(df.MainCoreIndex),
-		interval:        C.int(df.Interval),
-		metrics_num:     C.uint32_t(df.MetricsNum),
-		thresh_packets:  C.uint32_t(df.ThreshPackets),
-		thresh_bytes:    C.uint32_t(df.ThreshBytes),
+		done:                 0,
+		running:              0,
+		main_core_index:      C.int(df.MainCoreIndex),
+		interval:             C.int(df.Interval),
+		interval_align:       C.int(boolToInt(df.IntervalAlign)),
+		metrics_num:          C.uint32_t(df.MetricsNum),
+		thresh_packets:       C.uint32_t(df.ThreshPackets),
+		thresh_bytes:         C.uint32_t(df.ThreshBytes),
+		topk:                 C.uint32_t(df.TopK),
+		adaptive_aggregation: C.int(boolToInt(df.AdaptiveAggregation)),
+		rx_burst_size:        C.uint16_t(df.RxBurstSize),
+		ipfix_mtu:            C.uint16_t(df.IpfixMtu),
+		ipfix_domain_id:      C.uint32_t(df.IpfixDomainId),
 	}
 
 	local_nets_ipv4_index := 0
@@ -427,7 +675,53 @@ func (df *DpdkFlow) Start(acc telegraf.Accumulator) error {
 	aggregateFlagsExternal, _ := aggregateFlags(df.AggregateExternal)
 	df.ctx.aggregate_flags_external = C.uint32_t(aggregateFlagsExternal)
 
+	aggregates := map[int][]string{
+		C.DIRECTION_INCOMING: df.AggregateIncoming,
+		C.DIRECTION_OUTGOING: df.AggregateOutgoing,
+		C.DIRECTION_INTERNAL: df.AggregateInternal,
+		C.DIRECTION_EXTERNAL: df.AggregateExternal,
+	}
+	for direction, aggregate := range aggregates {
+		plens := aggregateHostPrefixLens(aggregate)
+		for i := range plens {
+			for j := range plens[i] {
+				df.ctx.host_plen[direction][i][j] = C.uint8_t(plens[i][j])
+			}
+		}
+	}
+
+	for degrade := 0; degrade < degradeLevels; degrade++ {
+		df.tagSchemas[C.DIRECTION_INCOMING][degrade] = newTagSchema(degradeFlags(aggregateFlagsIncoming, degrade))
+		df.tagSchemas[C.DIRECTION_OUTGOING][degrade] = newTagSchema(degradeFlags(aggregateFlagsOutgoing, degrade))
+		df.tagSchemas[C.DIRECTION_INTERNAL][degrade] = newTagSchema(degradeFlags(aggregateFlagsInternal, degrade))
+		df.tagSchemas[C.DIRECTION_EXTERNAL][degrade] = newTagSchema(degradeFlags(aggregateFlagsExternal, degrade))
+		for i := range df.tags {
+			df.tags[i][degrade] = make(map[string]string)
+		}
+	}
+	df.overflowTags = make(map[string]string)
+	df.fields = make(map[string]interface{})
+	ifaces := make(map[int8]string)
+	for _, c := range df.Cores {
+		for _, p := range c.Ports {
+			ifaces[int8(p.Index)] = p.Description
+		}
+	}
+	df.tagCache = newTagCache(ifaces)
+
 	C.strcpy(&df.ctx.mrt_rib_path[0], C.CString(df.MrtRibPath))
+	C.strcpy(&df.ctx.mrt_update_dir[0], C.CString(df.MrtUpdateDir))
+	peerIpv4, peerIpv6, _ := mrtPeers(df.MrtPeers)
+	setMrtPeers(df.ctx, peerIpv4, peerIpv6)
+	C.strcpy(&df.ctx.checkpoint_path[0], C.CString(df.CheckpointPath))
+
+	for i, a := range df.EalArgs {
+		C.strcpy(&df.ctx.eal_args[i][0], C.CString(a))
+	}
+	df.ctx.eal_args_num = C.int(len(df.EalArgs))
+
+	ipfixExport, _ := ipfixTarget(df.IpfixExport)
+	C.strcpy(&df.ctx.ipfix_export[0], C.CString(ipfixExport))
 
 	for i, c := range df.Cores {
 		ctx_core := &df.ctx.cores[i]
@@ -440,12 +734,18 @@ func (df *DpdkFlow) Start(acc telegraf.Accumulator) error {
 				ctx_port.tag_vlan_ids[i] = C.int32_t(v)
 			}
 			ctx_port.tag_vlan_num = C.int(len(p.TagVlanIds))
+			for i, q := range portQueues(p) {
+				ctx_port.queues[i] = C.uint16_t(q)
+			}
+			ctx_port.queue_num = C.int(len(portQueues(p)))
 		}
 		ctx_core.port_num = C.uint8_t(len(c.Ports))
 	}
 	df.ctx.core_num = C.uint8_t(len(df.Cores))
 
+	df.stopped = make(chan struct{})
 	go func() {
+		defer close(df.stopped)
 		C.start(df.ctx)
 	}()
 
@@ -479,6 +779,10 @@ func (df *DpdkFlow) Start(acc telegraf.Accumulator) error {
 func (df *DpdkFlow) Stop() {
 	fmt.Println("DpdkFlow.Stop()")
 	df.ctx.done = 1
+	// checkpoint_path の書き出しが終わるまで待つ。
+	if df.stopped != nil {
+		<-df.stopped
+	}
 }
 
 func init() {
@@ -486,3 +790,72 @@ func init() {
 		return NewDpdkFlow()
 	})
 }
+
+// mrt_peers を IPv4 と IPv6 のセッションのアドレスに分ける。指定しなかった方は nil 。
+func mrtPeers(peers []string) (net.IP, net.IP, error) {
+	var ipv4, ipv6 net.IP
+	for _, peer := range peers {
+		ip := net.ParseIP(peer)
+		if ip == nil {
+			return nil, nil, fmt.Errorf("mrt_peers: invalid address: %s", peer)
+		}
+		if ip.To4() != nil {
+			if ipv4 != nil {
+				return nil, nil, fmt.Errorf("mrt_peers: more than one IPv4 peer: %s", peer)
+			}
+			ipv4 = ip.To4()
+		} else {
+			if ipv6 != nil {
+				return nil, nil, fmt.Errorf("mrt_peers: more than one IPv6 peer: %s", peer)
+			}
+			ipv6 = ip.To16()
+		}
+	}
+	return ipv4, ipv6, nil
+}
+
+func setMrtPeers(ctx *C.struct_dpdkflow_context, ipv4 net.IP, ipv6 net.IP) {
+	ctx.mrt_peer_filter = 0
+	if ipv4 != nil {
+		for i := 0; i < 4; i++ {
+			ctx.mrt_peer_ipv4[i] = C.uint8_t(ipv4[i])
+		}
+		ctx.mrt_peer_filter |= C.MRT_PEER_IPV4
+	}
+	if ipv6 != nil {
+		for i := 0; i < 16; i++ {
+			ctx.mrt_peer_ipv6[i] = C.uint8_t(ipv6[i])
+		}
+		ctx.mrt_peer_filter |= C.MRT_PEER_IPV6
+	}
+}
+
+// ipfix_export の "udp://host:port" か "file:///path" を C 側の "udp:host:port", "file:path" にする。
+func ipfixTarget(export string) (string, error) {
+	if export == "" {
+		return "", nil
+	}
+	u, err := url.Parse(export)
+	if err != nil {
+		return "", fmt.Errorf("ipfix_export %s invalid: %v", export, err)
+	}
+	var target string
+	switch u.Scheme {
+	case "udp":
+		if u.Hostname() == "" || u.Port() == "" {
+			return "", fmt.Errorf("ipfix_export %s needs host and port", export)
+		}
+		target = "udp:" + u.Hostname() + ":" + u.Port()
+	case "file":
+		if u.Path == "" {
+			return "", fmt.Errorf("ipfix_export %s needs path", export)
+		}
+		target = "file:" + u.Path
+	default:
+		return "", fmt.Errorf("ipfix_export %s unknown scheme", export)
+	}
+	if len(target) > 255 {
+		return "", fmt.Errorf("ipfix_export too long")
+	}
+	return target, nil
+}
@@ -14,11 +14,12 @@ app_hash(uint32_t app)
 void
 fill_app_desc(char *app_desc, uint32_t app, struct dpdkflow_context *ctx)
 {
-	struct dpdkflow_app_table_entry *tmp;
+	struct dpdkflow_app_table_entry *tmp = NULL;
 	uint32_t hash = app_hash(app);
-	rte_rwlock_read_lock(&ctx->app_table_lock);
-	{
-		for (tmp = ctx->app_table->app_table_hash_table[hash]; tmp != NULL; tmp = tmp->next) {
+	/* app_table は RCU で守られているのでロックは取らない。 */
+	struct dpdkflow_app_table *app_table = __atomic_load_n(&ctx->app_table, __ATOMIC_ACQUIRE);
+	if (app_table != NULL) {
+		for (tmp = app_table->app_table_hash_table[hash]; tmp != NULL; tmp = tmp->next) {
 			if (tmp->app == app) {
 				break;
 			}
@@ -27,7 +28,6 @@ fill_app_desc(char *app_desc, uint32_t app, struct dpdkflow_context *ctx)
 			strcpy(app_desc, tmp->app_desc);
 		}
 	}
-	rte_rwlock_read_unlock(&ctx->app_table_lock);
 	if (tmp != NULL) {
 		return;
 	}
@@ -187,14 +187,12 @@ app_table_load(struct dpdkflow_context *ctx)
 	printf("app_table_load: app_desc_len_max = %d\n", app_desc_len_max);
 	printf("app_table_load: max_link_depth = %d\n", max_link_depth);
 
-	rte_rwlock_write_lock(&ctx->app_table_lock);
-	{
-		old_app_table = ctx->app_table;
-		ctx->app_table = new_app_table;
-		ctx->protocols_last_mtim = statbuf_protocols.st_mtim;
-		ctx->services_last_mtim = statbuf_services.st_mtim;
-	}
-	rte_rwlock_write_unlock(&ctx->app_table_lock);
+	old_app_table = ctx->app_table;
+	__atomic_store_n(&ctx->app_table, new_app_table, __ATOMIC_RELEASE);
+	ctx->protocols_last_mtim = statbuf_protocols.st_mtim;
+	ctx->services_last_mtim = statbuf_services.st_mtim;
+	/* 古いテーブルを引いている lcore_flow がいなくなるまで待つ。 */
+	rte_rcu_qsbr_synchronize(ctx->rcu, RTE_QSBR_THRID_INVALID);
 
 	if (old_app_table != NULL) {
 		for (int i = 0; i < APP_TABLE_HASH_SIZE; i++) {
@@ -230,7 +228,6 @@ app_table_context_init(struct dpdkflow_context *ctx)
 	printf("app_table_context_init\n");
 
 	ctx->app_table = NULL;
-	rte_rwlock_init(&ctx->app_table_lock);
 
 	app_table_load(ctx);
 }
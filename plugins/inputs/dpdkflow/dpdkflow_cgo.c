@@ -3,7 +3,12 @@
 const int8_t core_max = CORE_MAX;
 const int8_t port_max = PORT_MAX;
 const int8_t vlan_max = VLAN_MAX;
+const int8_t queue_max = QUEUE_MAX;
+const uint16_t burst_max = BURST_MAX;
 const int8_t local_nets_max = LOCAL_NETS_MAX;
+const int8_t eal_args_max = EAL_ARGS_MAX;
+const int16_t eal_arg_len = EAL_ARG_LEN;
+const uint8_t degrade_max = DEGRADE_MAX;
 
 const int8_t direction_incoming = DIRECTION_INCOMING;
 const int8_t direction_outgoing = DIRECTION_OUTGOING;
@@ -28,9 +33,10 @@ const uint32_t aggregate_f_app       = 0x0800;
 #define RX_RING_SIZE 2048
 #define TX_RING_SIZE 512
 
+#define PREFETCH_OFFSET 4
+
 //#define NUM_METRICS 65536
 #define NUM_METRICS 262144
-#define NUM_MBUFS 8191
 #define MBUF_CACHE_SIZE 250
 
 void
@@ -118,8 +124,52 @@ debug_print_ctx(struct dpdkflow_context *ctx)
 				printf("            k = %d\n", k);
 				printf("            tag_vlan_id = %d\n", ctx->cores[i].ports[j].tag_vlan_ids[k]);
 			}
+			for (int k = 0; k < ctx->cores[i].ports[j].queue_num; k++) {
+				printf("            k = %d\n", k);
+				printf("            queue = %d\n", ctx->cores[i].ports[j].queues[k]);
+			}
+		}
+	}
+}
+
+/* 32 ビットのワードのうち上位 bits ビットを残すマスク */
+static inline uint32_t
+host_word_mask(int bits)
+{
+	if (bits >= 32) {
+		return 0xffffffff;
+	}
+	if (bits <= 0) {
+		return 0;
+	}
+	return (uint32_t)((uint64_t)0xffffffff << (32 - bits));
+}
+
+/* host と prefix の先頭 plen ビットが一致するか。 IPv4 は後ろ 4 バイトに入っている。 */
+static inline int
+host_match(const uint8_t *host, const uint8_t *prefix, uint8_t af, int plen)
+{
+	int bits = (af == AF_IPV4) ? 96 + plen : plen;
+	for (int j = (af == AF_IPV4) ? 3 : 0; j < 4; j++) {
+		uint32_t netmask = host_word_mask(bits - j * 32);
+		uint32_t host_addr = ntohl(*(uint32_t *)&host[j * 4]);
+		uint32_t prefix_addr = ntohl(*(uint32_t *)&prefix[j * 4]);
+		if ((host_addr & netmask) != (prefix_addr & netmask)) {
+			return 0;
 		}
 	}
+	return 1;
+}
+
+/* host の先頭 plen ビットだけを残す。 */
+void
+host_mask(uint8_t *host, uint8_t af, int plen)
+{
+	int bits = (af == AF_IPV4) ? 96 + plen : plen;
+	for (int j = 0; j < 4; j++) {
+		uint32_t netmask = host_word_mask(bits - j * 32);
+		*(uint32_t *)&host[j * 4] = htonl(ntohl(*(uint32_t *)&host[j * 4]) & netmask);
+	}
 }
 
 int8_t
@@ -130,55 +180,15 @@ get_direction(struct dpdkflow_context *ctx, uint8_t af, uint8_t *src_host, uint8
 	int dst_match = 0;
 	switch (af) {
 	case AF_IPV4:
-		{
-			uint32_t src_addr = ntohl(*(uint32_t *)&src_host[12]);
-			uint32_t dst_addr = ntohl(*(uint32_t *)&dst_host[12]);
-			for (int i = 0; i < ctx->local_nets_ipv4_num; i++) {
-				int mask_shift = (32 - ctx->local_nets_ipv4_plen[i]);
-				uint32_t local_addr = ntohl(*(uint32_t *)&ctx->local_nets_ipv4_pfix[i][12]);
-				uint32_t netmask = (uint64_t)0xffffffff << mask_shift;
-				if ((src_addr & netmask) == (local_addr & netmask)) {
-					src_match++;
-				}
-				if ((dst_addr & netmask) == (local_addr & netmask)) {
-					dst_match++;
-				}
-			}
+		for (int i = 0; i < ctx->local_nets_ipv4_num; i++) {
+			src_match += host_match(src_host, ctx->local_nets_ipv4_pfix[i], af, ctx->local_nets_ipv4_plen[i]);
+			dst_match += host_match(dst_host, ctx->local_nets_ipv4_pfix[i], af, ctx->local_nets_ipv4_plen[i]);
 		}
 		break;
 	case AF_IPV6:
-		{
-			for (int i = 0; i < ctx->local_nets_ipv6_num; i++) {
-				int src_ne = 0;
-				int dst_ne = 0;
-				for (int j = 0; j < 4; j++) {
-					uint32_t src_addr = ntohl(*(uint32_t *)&src_host[j * 4]);
-					uint32_t dst_addr = ntohl(*(uint32_t *)&dst_host[j * 4]);
-					uint8_t *prefix_tmp = &ctx->local_nets_ipv6_pfix[i][j * 4];
-					uint32_t local_addr = ntohl(*(uint32_t *)prefix_tmp);
-					uint32_t netmask;
-					if (j < (ctx->local_nets_ipv6_plen[i] >> 5)) {
-						netmask = 0xffffffff;
-					} else if (j > (ctx->local_nets_ipv6_plen[i] >> 5)) {
-						netmask = 0x00000000;
-					} else {
-						int mask_shift = (32 - (ctx->local_nets_ipv6_plen[i] & 0x1f));
-						netmask = (uint64_t)0xffffffff << mask_shift;
-					}
-					if ((src_addr & netmask) != (local_addr & netmask)) {
-						src_ne++;
-					}
-					if ((dst_addr & netmask) != (local_addr & netmask)) {
-						dst_ne++;
-					}
-				}
-				if (!src_ne) {
-					src_match++;
-				}
-				if (!dst_ne) {
-					dst_match++;
-				}
-			}
+		for (int i = 0; i < ctx->local_nets_ipv6_num; i++) {
+			src_match += host_match(src_host, ctx->local_nets_ipv6_pfix[i], af, ctx->local_nets_ipv6_plen[i]);
+			dst_match += host_match(dst_host, ctx->local_nets_ipv6_pfix[i], af, ctx->local_nets_ipv6_plen[i]);
 		}
 		break;
 	}
@@ -290,14 +300,58 @@ port_index_max(struct dpdkflow_context *ctx)
 	return port_index_max;
 }
 
+int
+port_rx_queue_num(struct dpdkflow_context *ctx, uint16_t port)
+{
+	int rx_queue_num = 0;
+	for (int i = 0; i < ctx->core_num; i++) {
+		for (int j = 0; j < ctx->cores[i].port_num; j++) {
+			if (ctx->cores[i].ports[j].index != port) {
+				continue;
+			}
+			for (int k = 0; k < ctx->cores[i].ports[j].queue_num; k++) {
+				if (ctx->cores[i].ports[j].queues[k] + 1 > rx_queue_num) {
+					rx_queue_num = ctx->cores[i].ports[j].queues[k] + 1;
+				}
+			}
+		}
+	}
+	return rx_queue_num;
+}
+
+/*
+ * mbuf_pool の大きさ。すべての RX/TX キューの記述子に加えて、 lcore ごとのキャッシュと
+ * rte_eth_rx_burst で手元に持つ分が同時に使われても足りるようにする。
+ */
+static unsigned int
+mbuf_num(struct dpdkflow_context *ctx)
+{
+	int port_counted[PORT_MAX] = {0};
+	unsigned int n = 0;
+	for (int i = 0; i < ctx->core_num; i++) {
+		for (int j = 0; j < ctx->cores[i].port_num; j++) {
+			uint16_t port = ctx->cores[i].ports[j].index;
+			if (port_counted[port]) {
+				continue;
+			}
+			port_counted[port] = 1;
+			n += port_rx_queue_num(ctx, port) * RX_RING_SIZE + TX_RING_SIZE;
+		}
+	}
+	n += rte_lcore_count() * (MBUF_CACHE_SIZE + BURST_MAX);
+	/* rte_mempool は 2^n - 1 個のときにいちばん無駄なくメモリを使う。 */
+	return rte_align32pow2(n + 1) - 1;
+}
+
 static inline int
 port_init(struct dpdkflow_context *ctx, uint16_t port)
 {
 	struct rte_eth_conf port_conf;
-	const uint16_t rx_rings = 1, tx_rings = 1;
+	const uint16_t rx_rings = port_rx_queue_num(ctx, port), tx_rings = 1;
 	uint16_t nb_rxd = RX_RING_SIZE;
 	uint16_t nb_txd = TX_RING_SIZE;
 	uint16_t q;
+	int ret;
 	struct rte_eth_dev_info dev_info;
 	struct rte_eth_txconf txconf;
 
@@ -316,6 +370,23 @@ port_init(struct dpdkflow_context *ctx, uint16_t port)
 		port_conf.txmode.offloads |= DEV_TX_OFFLOAD_MBUF_FAST_FREE;
 	}
 
+	if (rx_rings > dev_info.max_rx_queues) {
+		printf("port_init: too many rx queues: %d > %d\n", rx_rings, dev_info.max_rx_queues);
+		return -1;
+	}
+
+	if (rx_rings > 1) {
+		/* 複数の RX キューに RSS でパケットを振り分ける。 */
+		port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+		port_conf.rx_adv_conf.rss_conf.rss_key = NULL;
+		port_conf.rx_adv_conf.rss_conf.rss_hf =
+			(ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP) & dev_info.flow_type_rss_offloads;
+		if (port_conf.rx_adv_conf.rss_conf.rss_hf == 0) {
+			printf("port_init: rss not supported\n");
+			return -1;
+		}
+	}
+
 	if (rte_eth_dev_configure(port, rx_rings, tx_rings, &port_conf) != 0) {
 		printf("port_init: rte_eth_dev_configure failed\n");
 		return -1;
@@ -347,7 +418,11 @@ port_init(struct dpdkflow_context *ctx, uint16_t port)
 		return -1;
 	}
 
-	if (rte_eth_promiscuous_enable(port) != 0) {
+	ret = rte_eth_promiscuous_enable(port);
+	if (ret == -ENOTSUP) {
+		/* 仮想デバイスなどプロミスキャスモードを持たないポートはそのまま使う。 */
+		printf("port_init: promiscuous mode not supported: port%d\n", port);
+	} else if (ret != 0) {
 		printf("port_init: rte_eth_promiscuous_enable failed\n");
 		return -1;
 	}
@@ -363,15 +438,272 @@ now()
 	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
 }
 
+/*
+ * 方向と AS 番号をバースト分まとめて求める。同じアドレスの組のパケットは続けて来ることが多いので、
+ * lcore_flow ごとの host_cache に覚えておき、 get_direction と LPM を引かずに済ませる。
+ * host_cache になかったアドレスは AF ごとに集めて mrt_rib_lookup_bulk で一度に引く。
+ */
+static inline void
+host_resolve_bulk(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard,
+		struct dpdkflow_packet *pkts, int *valid, int n)
+{
+	/* 新しいテーブルを引くよう、世代はテーブルより先に読む。 */
+	uint32_t generation = __atomic_load_n(&ctx->host_cache_generation, __ATOMIC_ACQUIRE);
+	uint8_t addrs[2][HOST_LOOKUP_MAX][16];
+	uint32_t *results[2][HOST_LOOKUP_MAX];
+	uint32_t as_nums[HOST_LOOKUP_MAX];
+	int lookup_num[2] = {0, 0};
+	uint32_t missed_hashes[BURST_MAX];
+	int missed[BURST_MAX];
+	int missed_num = 0;
+	for (int k = 0; k < n; k++) {
+		struct dpdkflow_packet *pkt = &pkts[k];
+		if (!valid[k]) {
+			continue;
+		}
+		uint32_t hash = rte_hash_crc(pkt->src_host, 16, rte_hash_crc(pkt->dst_host, 16, pkt->af));
+		struct dpdkflow_host_cache_entry *e = &shard->host_cache[hash & (HOST_CACHE_SIZE - 1)];
+		if (e->generation == generation && e->af == pkt->af
+		 && memcmp(e->src_host, pkt->src_host, 16) == 0 && memcmp(e->dst_host, pkt->dst_host, 16) == 0) {
+			pkt->direction = e->direction;
+			pkt->src_as = e->src_as;
+			pkt->dst_as = e->dst_as;
+			shard->host_cache_hits++;
+			continue;
+		}
+		shard->host_cache_misses++;
+		pkt->direction = get_direction(ctx, pkt->af, pkt->src_host, pkt->dst_host);
+		uint32_t flags = aggregate_flags(ctx, pkt->direction);
+		int a = (pkt->af == AF_IPV6) ? 1 : 0;
+		pkt->src_as = 0;
+		pkt->dst_as = 0;
+		if (flags & aggregate_f_src_as) {
+			memcpy(addrs[a][lookup_num[a]], pkt->src_host, 16);
+			results[a][lookup_num[a]++] = &pkt->src_as;
+		}
+		if (flags & aggregate_f_dst_as) {
+			memcpy(addrs[a][lookup_num[a]], pkt->dst_host, 16);
+			results[a][lookup_num[a]++] = &pkt->dst_as;
+		}
+		missed_hashes[missed_num] = hash;
+		missed[missed_num++] = k;
+	}
+	for (int a = 0; a < 2; a++) {
+		if (lookup_num[a] == 0) {
+			continue;
+		}
+		mrt_rib_lookup_bulk(ctx, a ? AF_IPV6 : AF_IPV4, addrs[a], as_nums, lookup_num[a]);
+		for (int i = 0; i < lookup_num[a]; i++) {
+			*results[a][i] = as_nums[i];
+		}
+	}
+	/* 同じ組がバースト内で何度か外れていれば、同じ値で何度か書くだけ。 */
+	for (int i = 0; i < missed_num; i++) {
+		struct dpdkflow_packet *pkt = &pkts[missed[i]];
+		struct dpdkflow_host_cache_entry *e = &shard->host_cache[missed_hashes[i] & (HOST_CACHE_SIZE - 1)];
+		memcpy(e->src_host, pkt->src_host, 16);
+		memcpy(e->dst_host, pkt->dst_host, 16);
+		e->af = pkt->af;
+		e->direction = pkt->direction;
+		e->src_as = pkt->src_as;
+		e->dst_as = pkt->dst_as;
+		e->generation = generation;
+	}
+}
+
+/* ヘッダから集計に使う値を取り出す。集計しないパケットなら 0 を返す。 */
+static inline int
+packet_parse(struct dpdkflow_context *ctx, struct dpdkflow_context_port *port, struct rte_mbuf *buf,
+		struct dpdkflow_packet *pkt)
+{
+	uint8_t *src_host = pkt->src_host;
+	uint8_t *dst_host = pkt->dst_host;
+	uint8_t proto = 0;
+	memset(src_host, 0, 16);
+	memset(dst_host, 0, 16);
+	pkt->iface = port->index;
+	pkt->vlan = port->port_vlan_id;
+	pkt->src_port = -1;
+	pkt->dst_port = -1;
+	pkt->bytes = buf->pkt_len;
+	uint8_t *p = (uint8_t *)buf->buf_addr + buf->data_off;
+	struct rte_ether_hdr *eth_hdr = (struct rte_ether_hdr *)p;
+	p = (uint8_t *)(eth_hdr + 1);
+	uint16_t ether_type = rte_be_to_cpu_16(eth_hdr->ether_type);
+	if (ether_type == 0x8100) {
+		pkt->bytes -= 4; /* VLAN 拡張ヘッダ分は無視する。 */
+		struct rte_vlan_hdr *vlan_hdr = (struct rte_vlan_hdr *)p;
+		p = (uint8_t *)(vlan_hdr + 1);
+		pkt->vlan = rte_be_to_cpu_16(vlan_hdr->vlan_tci) & 0x0fff;
+		int vlan_included = 0;
+		for (int l = 0; l < port->tag_vlan_num; l++) {
+			if (port->tag_vlan_ids[l] == pkt->vlan)
+				vlan_included += 1;
+		}
+		if (!vlan_included)
+			return 0;
+		ether_type = rte_be_to_cpu_16(vlan_hdr->eth_proto);
+	}
+	switch (ether_type) {
+	case 0x0800: /* IPv4 */
+		{
+			pkt->af = af_ipv4;
+			struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *)p;
+			p = (uint8_t *)p + (ipv4_hdr->version_ihl & RTE_IPV4_HDR_IHL_MASK)
+					 * RTE_IPV4_IHL_MULTIPLIER;
+			if ((rte_be_to_cpu_16(ipv4_hdr->fragment_offset)
+			  & RTE_IPV4_HDR_OFFSET_MASK) == 0) {
+				proto = ipv4_hdr->next_proto_id;
+			} else {
+				proto = IPPROTO_FRAGMENT;
+			}
+			*((uint32_t *)&src_host[12]) = ipv4_hdr->src_addr;
+			*((uint32_t *)&dst_host[12]) = ipv4_hdr->dst_addr;
+		}
+		break;
+	case 0x86dd: /* IPv6 */
+		{
+			pkt->af = af_ipv6;
+			struct rte_ipv6_hdr *ipv6_hdr = (struct rte_ipv6_hdr *)p;
+			p = (uint8_t *)(ipv6_hdr + 1);
+			proto = ipv6_hdr->proto;
+			if (proto == IPPROTO_FRAGMENT) {
+				struct ipv6_extension_fragment *frag_hdr =
+					(struct ipv6_extension_fragment *)p;
+				p = (uint8_t *)(frag_hdr + 1);
+				if (frag_hdr->frag_data == 0) {
+					proto = frag_hdr->next_header;
+				}
+			}
+			memcpy(src_host, &ipv6_hdr->src_addr[0], 16);
+			memcpy(dst_host, &ipv6_hdr->dst_addr[0], 16);
+		}
+		break;
+	default:
+		return 0;
+	}
+	switch (proto) {
+	case IPPROTO_UDP:
+		{
+			struct rte_udp_hdr *udp_hdr = (struct rte_udp_hdr *)p;
+			p = (uint8_t *)(udp_hdr + 1);
+			pkt->src_port = rte_be_to_cpu_16(udp_hdr->src_port);
+			pkt->dst_port = rte_be_to_cpu_16(udp_hdr->dst_port);
+		}
+		break;
+	case IPPROTO_TCP:
+		{
+			struct rte_tcp_hdr *tcp_hdr = (struct rte_tcp_hdr *)p;
+			p = (uint8_t *)(tcp_hdr + 1);
+			pkt->src_port = rte_be_to_cpu_16(tcp_hdr->src_port);
+			pkt->dst_port = rte_be_to_cpu_16(tcp_hdr->dst_port);
+		}
+		break;
+	}
+	pkt->proto = proto;
+	return 1;
+}
+
+static inline void
+packet_to_metric(struct dpdkflow_context *ctx, struct dpdkflow_packet *pkt, uint64_t start_time, uint8_t degrade,
+		struct dpdkflow_metric *m)
+{
+	int8_t direction = pkt->direction;
+	uint8_t af = pkt->af;
+	uint8_t proto = pkt->proto;
+	uint8_t *src_host = pkt->src_host;
+	uint8_t *dst_host = pkt->dst_host;
+	int src_port = pkt->src_port;
+	int dst_port = pkt->dst_port;
+	uint32_t flags = aggregate_flags(ctx, direction);
+	uint32_t app = 0;
+	metric_init(m);
+	m->start_time = start_time;
+	m->packets = 1;
+	m->bytes = pkt->bytes;
+	if (degrade > 0) {
+		flags = degrade_flags(flags, degrade);
+	}
+	if (flags & (aggregate_f_src_host | aggregate_f_dst_host)) {
+		int af_index = (af == AF_IPV6) ? 1 : 0;
+		int src_plen = ctx->host_plen[direction][0][af_index];
+		int dst_plen = ctx->host_plen[direction][1][af_index];
+		if (degrade == DEGRADE_PREFIX) {
+			int degrade_plen = (af == AF_IPV4) ? 24 : 48;
+			src_plen = (src_plen < degrade_plen) ? src_plen : degrade_plen;
+			dst_plen = (dst_plen < degrade_plen) ? dst_plen : degrade_plen;
+		}
+		if (src_plen < ((af == AF_IPV4) ? 32 : 128)) {
+			host_mask(src_host, af, src_plen);
+		}
+		if (dst_plen < ((af == AF_IPV4) ? 32 : 128)) {
+			host_mask(dst_host, af, dst_plen);
+		}
+	}
+	int min_port = (src_port < dst_port) ? src_port : dst_port;
+	if (min_port > 0) {
+		app = ((uint32_t)proto << 16) | ((uint32_t)min_port);
+	} else {
+		app = ((uint32_t)proto << 16);
+	}
+	m->key.direction = direction;
+	m->key.degrade = degrade;
+	if (flags & aggregate_f_iface) {
+		m->key.iface = pkt->iface;
+	}
+	if (flags & aggregate_f_af) {
+		m->key.af = af;
+	}
+	if (flags & aggregate_f_proto) {
+		m->key.proto = proto;
+	}
+	if (flags & aggregate_f_vlan) {
+		m->key.vlan = pkt->vlan;
+	}
+	if (flags & aggregate_f_src_host) {
+		memcpy(&m->key.src_host[0], src_host, 16);
+	}
+	if (flags & aggregate_f_dst_host) {
+		memcpy(&m->key.dst_host[0], dst_host, 16);
+	}
+	if (flags & aggregate_f_src_as) {
+		m->key.src_as = pkt->src_as;
+	}
+	if (flags & aggregate_f_dst_as) {
+		m->key.dst_as = pkt->dst_as;
+	}
+	if (flags & aggregate_f_src_port) {
+		m->key.src_port = src_port;
+	}
+	if (flags & aggregate_f_dst_port) {
+		m->key.dst_port = dst_port;
+	}
+	if (flags & aggregate_f_app) {
+		m->key.app = app;
+	}
+}
+
 static int
 lcore_flow(void *arg)
 {
 	struct dpdkflow_context *ctx = (struct dpdkflow_context *)arg;
 	struct dpdkflow_context_core *me = NULL;
+	struct dpdkflow_metric_shard *shard = NULL;
+	struct dpdkflow_stats *stats = NULL;
 	unsigned my_core_id = rte_lcore_id();
+	unsigned thread_id = 0;
+	struct rte_mbuf *bufs[BURST_MAX];
+	struct dpdkflow_packet pkts[BURST_MAX];
+	struct dpdkflow_metric metrics[BURST_MAX];
+	struct dpdkflow_metric *found[BURST_MAX];
+	int valid[BURST_MAX];
+	uint32_t hashes[BURST_MAX];
 	for (int i = 0; i < ctx->core_num; i++) {
 		if (ctx->cores[i].index == my_core_id) {
 			me = &ctx->cores[i];
+			shard = &ctx->metric_shards[i];
+			stats = &ctx->stats[i];
+			thread_id = i;
 		}
 	}
 	if (me == NULL) {
@@ -379,209 +711,188 @@ lcore_flow(void *arg)
 		return -1;
 	}
 	printf("#### lcore_flow: %d\n", my_core_id);
-	for (;;) {
+	rte_rcu_qsbr_thread_register(ctx->rcu, thread_id);
+	rte_rcu_qsbr_thread_online(ctx->rcu, thread_id);
+	uint64_t start_time;
+	while (!__atomic_load_n(&ctx->done, __ATOMIC_RELAXED)) {
+		/* ここでは mrt_rib と app_table を引いていない。 */
+		rte_rcu_qsbr_quiescent(ctx->rcu, thread_id);
+		metric_epoch_sync(ctx, shard);
 		for (int j = 0; j < me->port_num; j++) {
-			struct rte_mbuf *bufs[4];
-			const uint16_t nb_rx = rte_eth_rx_burst(me->ports[j].index, 0, bufs, 4);
-			uint64_t start_time = now();
-			for (int k = 0; k < nb_rx; k++) {
-				int8_t iface = me->ports[j].index;
-				int8_t direction = -1;
-				uint8_t af = 0;
-				uint8_t proto = 0;
-				int32_t vlan = me->ports[j].port_vlan_id;
-				uint8_t src_host[16] = {0};
-				uint8_t dst_host[16] = {0};
-				int64_t src_as = -1;
-				int64_t dst_as = -1;
-				int src_port = -1;
-				int dst_port = -1;
-				uint32_t app = 0;
-				struct dpdkflow_metric *m;
-				if (rte_mempool_get(ctx->metric_pool, (void **)&m) < 0) {
-					rte_rwlock_write_lock(&ctx->metric_stats_lock);
-					ctx->metric_getfailed++;
-					rte_rwlock_write_unlock(&ctx->metric_stats_lock);
-					goto free_mbuf;
-				} else {
-					rte_rwlock_write_lock(&ctx->metric_stats_lock);
-					ctx->metric_alloced++;
-					rte_rwlock_write_unlock(&ctx->metric_stats_lock);
+			for (int q = 0; q < me->ports[j].queue_num; q++) {
+				const uint16_t nb_rx = rte_eth_rx_burst(me->ports[j].index, me->ports[j].queues[q],
+						bufs, ctx->rx_burst_size);
+				if (nb_rx == 0) {
+					continue;
+				}
+				start_time = clock_now(ctx);
+				if (ctx->adaptive_aggregation && ctx->topk == 0) {
+					metric_degrade_update(ctx, shard);
+				}
+				/* ヘッダを先読みしつつバースト全体を解析する。 */
+				for (int k = 0; k < nb_rx && k < PREFETCH_OFFSET; k++) {
+					rte_prefetch0(rte_pktmbuf_mtod(bufs[k], void *));
 				}
-				metric_init(m);
-				m->start_time = start_time;
-				m->packets = 1;
-				m->bytes = bufs[k]->pkt_len;
-				uint8_t *p = (uint8_t *)bufs[k]->buf_addr + bufs[k]->data_off;
-				struct rte_ether_hdr *eth_hdr = (struct rte_ether_hdr *)p;
-				p = (uint8_t *)(eth_hdr + 1);
-				uint16_t ether_type = rte_be_to_cpu_16(eth_hdr->ether_type);
-				if (ether_type == 0x8100) {
-					m->bytes -= 4; /* VLAN 拡張ヘッダ分は無視する。 */
-					struct rte_vlan_hdr *vlan_hdr = (struct rte_vlan_hdr *)p;
-					p = (uint8_t *)(vlan_hdr + 1);
-					vlan = rte_be_to_cpu_16(vlan_hdr->vlan_tci) & 0x0fff;
-					int vlan_included = 0;
-					for (int l = 0; l < me->ports[j].tag_vlan_num; l++) {
-						if (me->ports[j].tag_vlan_ids[l] == vlan)
-							vlan_included += 1;
+				for (int k = 0; k < nb_rx; k++) {
+					if (k + PREFETCH_OFFSET < nb_rx) {
+						rte_prefetch0(rte_pktmbuf_mtod(bufs[k + PREFETCH_OFFSET], void *));
 					}
-					if (!vlan_included)
-						goto free_metric;
-					ether_type = rte_be_to_cpu_16(vlan_hdr->eth_proto);
+					valid[k] = packet_parse(ctx, &me->ports[j], bufs[k], &pkts[k]);
+					rte_pktmbuf_free(bufs[k]);
 				}
-				switch (ether_type) {
-				case 0x0800: /* IPv4 */
-					{
-						af = af_ipv4;
-						struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *)p;
-						p = (uint8_t *)p + (ipv4_hdr->version_ihl & RTE_IPV4_HDR_IHL_MASK)
-								 * RTE_IPV4_IHL_MULTIPLIER;
-						if ((rte_be_to_cpu_16(ipv4_hdr->fragment_offset)
-						  & RTE_IPV4_HDR_OFFSET_MASK) == 0) {
-							proto = ipv4_hdr->next_proto_id;
-						} else {
-							proto = IPPROTO_FRAGMENT;
-						}
-						*((uint32_t *)&src_host[12]) = ipv4_hdr->src_addr;
-						*((uint32_t *)&dst_host[12]) = ipv4_hdr->dst_addr;
+				host_resolve_bulk(ctx, shard, pkts, valid, nb_rx);
+				for (int k = 0; k < nb_rx; k++) {
+					if (valid[k]) {
+						packet_to_metric(ctx, &pkts[k], start_time, shard->metric_degrade, &metrics[k]);
+						hashes[k] = metric_hash(&metrics[k]);
 					}
-					break;
-				case 0x86dd: /* IPv6 */
-					{
-						af = af_ipv6;
-						struct rte_ipv6_hdr *ipv6_hdr = (struct rte_ipv6_hdr *)p;
-						p = (uint8_t *)(ipv6_hdr + 1);
-						proto = ipv6_hdr->proto;
-						if (proto == IPPROTO_FRAGMENT) {
-							struct ipv6_extension_fragment *frag_hdr =
-								(struct ipv6_extension_fragment *)p;
-							p = (uint8_t *)(frag_hdr + 1);
-							if (frag_hdr->frag_data == 0) {
-								proto = frag_hdr->next_header;
-							}
+				}
+				if (ctx->topk > 0) {
+					for (int k = 0; k < nb_rx; k++) {
+						if (valid[k]) {
+							topk_update(ctx, shard, &metrics[k], hashes[k]);
 						}
-						memcpy(src_host, &ipv6_hdr->src_addr[0], 16);
-						memcpy(dst_host, &ipv6_hdr->dst_addr[0], 16);
 					}
-					break;
-				default:
-					goto free_metric;
+					continue;
 				}
-				direction = get_direction(ctx, af, src_host, dst_host);
-				if (aggregate_flag_up(ctx, direction, aggregate_f_src_as)) {
-					src_as = mrt_rib_lookup(ctx, af, src_host);
+				/* 既存のフローをまとめて探し、新しいフローの分だけまとめて確保しておく。 */
+				metric_table_lookup_bulk(metric_shard_table(shard), metrics, hashes, valid, nb_rx, found);
+				int missed = 0;
+				for (int k = 0; k < nb_rx; k++) {
+					if (valid[k] && found[k] == NULL) {
+						missed++;
+					}
 				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_dst_as)) {
-					dst_as = mrt_rib_lookup(ctx, af, dst_host);
+				if (missed > 0) {
+					metric_cache_fill(ctx, shard, missed);
 				}
-				switch (proto) {
-				case IPPROTO_UDP:
-					{
-						struct rte_udp_hdr *udp_hdr = (struct rte_udp_hdr *)p;
-						p = (uint8_t *)(udp_hdr + 1);
-						src_port = rte_be_to_cpu_16(udp_hdr->src_port);
-						dst_port = rte_be_to_cpu_16(udp_hdr->dst_port);
+				for (int k = 0; k < nb_rx; k++) {
+					struct dpdkflow_metric *m;
+					if (!valid[k]) {
+						continue;
 					}
-					break;
-				case IPPROTO_TCP:
-					{
-						struct rte_tcp_hdr *tcp_hdr = (struct rte_tcp_hdr *)p;
-						p = (uint8_t *)(tcp_hdr + 1);
-						src_port = rte_be_to_cpu_16(tcp_hdr->src_port);
-						dst_port = rte_be_to_cpu_16(tcp_hdr->dst_port);
+					m = found[k];
+					if (m == NULL) {
+						/* 同じバースト内で先に登録されたかもしれないので探し直す。 */
+						m = metric_table_lookup(metric_shard_table(shard), &metrics[k], hashes[k]);
+					}
+					if (m != NULL) {
+						/* シャードはこの lcore だけが書き換えるのでロックもアトミック操作も要らない。 */
+						m->packets += metrics[k].packets;
+						m->bytes += metrics[k].bytes;
+						continue;
+					}
+					m = metric_cache_get(shard);
+					if (m == NULL) {
+						metric_overflow(shard, &metrics[k]);
+						stats->metric_getfailed++;
+						continue;
+					}
+					*m = metrics[k];
+					if (metric_insert(ctx, shard, m, hashes[k]) != 0) {
+						shard->metric_cache[shard->metric_cache_num++] = m;
+						metric_overflow(shard, &metrics[k]);
+						stats->metric_getfailed++;
+						continue;
+					}
+					stats->metric_alloced++;
+					if (degrade_flags(aggregate_flags(ctx, m->key.direction), m->key.degrade) & aggregate_f_app) {
+						fill_app_desc(m->app_desc, m->key.app, ctx);
 					}
-					break;
-				}
-				int min_port = (src_port < dst_port) ? src_port : dst_port;
-				if (min_port > 0) {
-					app = ((uint32_t)proto << 16) | ((uint32_t)min_port);
-				} else {
-					app = ((uint32_t)proto << 16);
-				}
-				m->direction = direction;
-				if (aggregate_flag_up(ctx, direction, aggregate_f_iface)) {
-					m->iface = iface;
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_af)) {
-					m->af = af;
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_proto)) {
-					m->proto = proto;
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_vlan)) {
-					m->vlan = vlan;
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_src_host)) {
-					memcpy(&m->src_host[0], src_host, 16);
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_dst_host)) {
-					memcpy(&m->dst_host[0], dst_host, 16);
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_src_as)) {
-					m->src_as = src_as;
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_dst_as)) {
-					m->dst_as = dst_as;
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_src_port)) {
-					m->src_port = src_port;
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_dst_port)) {
-					m->dst_port = dst_port;
-				}
-				if (aggregate_flag_up(ctx, direction, aggregate_f_app)) {
-					m->app = app;
-					fill_app_desc(m->app_desc, m->app, ctx);
-				}
-				int stored;
-				metric_update(ctx, m, &stored);
-				if (stored) {
-					/* コンテキストのメトリックテーブルに格納されたので put しない。 */
-					goto free_mbuf;
 				}
-free_metric:
-				rte_mempool_put(ctx->metric_pool, (void *)m);
-				rte_rwlock_write_lock(&ctx->metric_stats_lock);
-				ctx->metric_alloced--;
-				rte_rwlock_write_unlock(&ctx->metric_stats_lock);
-free_mbuf:
-				rte_pktmbuf_free(bufs[k]);
 			}
 		}
 	}
+	/* 止まった lcore_flow を待たないようにする。 */
+	rte_rcu_qsbr_thread_offline(ctx->rcu, thread_id);
+	rte_rcu_qsbr_thread_unregister(ctx->rcu, thread_id);
+	return 0;
+}
+
+/* 吐き出すメトリックは export_batch に写し、溜まったら Go にまとめて渡す。 */
+void
+metric_export_append(struct dpdkflow_context *ctx, struct dpdkflow_metric *m)
+{
+	//metric_print(m);
+	if (ctx->ipfix != NULL) {
+		/* IPFIX で書き出すときは Go を通さない。 */
+		ipfix_add(ctx->ipfix, m);
+		ctx->stats[ctx->core_num].metric_sent++;
+		return;
+	}
+	ctx->export_batch[ctx->export_batch_num++] = *m;
+	if (ctx->export_batch_num == EXPORT_BATCH_SIZE) {
+		metric_export_flush(ctx);
+	}
+}
+
+void
+metric_export_record(struct dpdkflow_context *ctx, struct dpdkflow_metric *m)
+{
+	if ((ctx->thresh_packets > 0 && m->packets < ctx->thresh_packets)
+	 || (ctx->thresh_bytes > 0 && m->bytes < ctx->thresh_bytes)) {
+		ctx->stats[ctx->core_num].metric_ignored++;
+		return;
+	}
+	metric_export_append(ctx, m);
 }
 
-static void
+void
+metric_export(struct dpdkflow_context *ctx, struct dpdkflow_metric *m)
+{
+	metric_export_record(ctx, m);
+	rte_mempool_put(ctx->metric_pool, (void *)m);
+	ctx->stats[ctx->core_num].metric_freed++;
+}
+
+void
+metric_export_flush(struct dpdkflow_context *ctx)
+{
+	extern int gather_batch(struct dpdkflow_metric *batch, int n, uint64_t time);
+	if (ctx->ipfix != NULL) {
+		ipfix_flush(ctx->ipfix);
+	}
+	if (ctx->export_batch_num == 0) {
+		return;
+	}
+	gather_batch(ctx->export_batch, ctx->export_batch_num, ctx->metric_export_time);
+	ctx->stats[ctx->core_num].metric_sent += ctx->export_batch_num;
+	ctx->export_batch_num = 0;
+}
+
+/* 直前のエポックを吐き出さずに終わったときは 1 を返す。 */
+static int
 lcore_main(struct dpdkflow_context *ctx)
 {
-	extern int gather(struct dpdkflow_metric *m);
 	printf("#### lcore_main: %d\n", rte_lcore_id());
-	while (!ctx->done) {
-		struct dpdkflow_metric *mbuf[8];
-		int deqed = metric_deq(ctx, mbuf, 8);
-		if (deqed == 0) {
-			usleep(500);
+	while (!__atomic_load_n(&ctx->done, __ATOMIC_RELAXED)) {
+		clock_calibrate_if_needed(ctx);
+		uint64_t current_time = clock_now(ctx);
+		if (!metric_epoch_expired(ctx, current_time)) {
+			/* 次の区切りまで寝る。停止と時計の較正のため長くても 100ms で起きる。 */
+			uint64_t remain = ctx->metric_epoch_end - current_time;
+			usleep(remain < 100000 ? remain : 100000);
 			continue;
 		}
-		for (int i = 0; i < deqed; i++) {
-			//metric_print(mbuf[i]);
-			if ((ctx->thresh_packets > 0 && mbuf[i]->packets < ctx->thresh_packets)
-			 || (ctx->thresh_bytes > 0 && mbuf[i]->bytes < ctx->thresh_bytes)) {
-				rte_mempool_put(ctx->metric_pool, (void *)mbuf[i]);
-				rte_rwlock_write_lock(&ctx->metric_stats_lock);
-				ctx->metric_ignored++;
-				ctx->metric_alloced--;
-				rte_rwlock_write_unlock(&ctx->metric_stats_lock);
-			} else {
-				gather(mbuf[i]);
-				rte_mempool_put(ctx->metric_pool, (void *)mbuf[i]);
-				rte_rwlock_write_lock(&ctx->metric_stats_lock);
-				ctx->metric_sent++;
-				ctx->metric_alloced--;
-				rte_rwlock_write_unlock(&ctx->metric_stats_lock);
-			}
+		if (metric_epoch_flip(ctx, current_time) != 0) {
+			return 1;
 		}
+		metric_epoch_drain(ctx);
+	}
+	return 0;
+}
+
+void
+stats_sum(struct dpdkflow_context *ctx, struct dpdkflow_stats *sum)
+{
+	memset(sum, 0, sizeof(struct dpdkflow_stats));
+	for (int i = 0; i <= ctx->core_num; i++) {
+		volatile struct dpdkflow_stats *stats = &ctx->stats[i];
+		sum->metric_alloced += stats->metric_alloced;
+		sum->metric_freed += stats->metric_freed;
+		sum->metric_getfailed += stats->metric_getfailed;
+		sum->metric_sent += stats->metric_sent;
+		sum->metric_ignored += stats->metric_ignored;
 	}
 }
 
@@ -593,11 +904,14 @@ print_stats(struct dpdkflow_context *ctx)
 	static uint64_t ignored_last = 0;
 	static uint64_t imissed_last[PORT_MAX] = {0};
 	static uint64_t rx_nombuf_last[PORT_MAX] = {0};
-	char buf[256];
+	char buf[2048];
 	char buf2[128];
 	char *p = buf;
 	time_t rawtime;
 	struct tm * timeinfo;
+	struct dpdkflow_stats sum;
+
+	stats_sum(ctx, &sum);
 
 	time(&rawtime);
 	timeinfo = localtime(&rawtime);
@@ -609,40 +923,47 @@ print_stats(struct dpdkflow_context *ctx)
 	p += strlen(" stats: ");
 
 	sprintf(buf2, "sent = %8ld ignored = %8ld alloced = %8ld getfailed = %8ld ",
-			(ctx->metric_sent - sent_last),
-			(ctx->metric_ignored - ignored_last),
-			ctx->metric_alloced,
-			(ctx->metric_getfailed - getfailed_last));
+			(sum.metric_sent - sent_last),
+			(sum.metric_ignored - ignored_last),
+			(sum.metric_alloced - sum.metric_freed),
+			(sum.metric_getfailed - getfailed_last));
 	sprintf(p, "%s", buf2);
 	p += strlen(buf2);
 
-	/*
-	{
-		int maxdepth = 0;
-		for (int i = 0; i < ctx->metrics_num; i++) {
-			struct dpdkflow_metric *tmp;
-			int depth = 0;
-			rte_rwlock_read_lock(&ctx->metric_lock);
-			for (tmp = ctx->metric_hash_table[i]; tmp != NULL; tmp = tmp->hash_next) {
-				depth++;
-			}
-			rte_rwlock_read_unlock(&ctx->metric_lock);
-			if (depth > maxdepth) {
-				maxdepth = depth;
+	for (int i = 0; i < ctx->core_num; i++) {
+		struct dpdkflow_metric_table *t = metric_shard_table(&ctx->metric_shards[i]);
+		struct dpdkflow_metric_table *u = &ctx->metric_shards[i].metric_tables[0];
+		struct dpdkflow_metric_table *v = &ctx->metric_shards[i].metric_tables[1];
+		uint64_t lookups = u->lookups + v->lookups;
+		uint64_t insert_failed = u->insert_failed + v->insert_failed;
+		for (int e = 0; ctx->topk > 0 && e < 2; e++) {
+			for (int d = DIRECTION_INCOMING; d < DIRECTION_NUM; d++) {
+				insert_failed += ctx->metric_shards[i].topk[e][d].table.insert_failed;
 			}
 		}
-		sprintf(buf2, "maxdepth = %4d ", maxdepth);
+		uint64_t host_lookups = ctx->metric_shards[i].host_cache_hits + ctx->metric_shards[i].host_cache_misses;
+		sprintf(buf2, " {%d} load = %3d%% degrade = %d alt = %3d%% kicks = %8ld insert_failed = %8ld host_hit = %3d%% ",
+				i,
+				(int)((uint64_t)t->entries * 100 / t->slots),
+				ctx->metric_shards[i].metric_degrade,
+				(int)(lookups > 0 ? (u->lookups_alt + v->lookups_alt) * 100 / lookups : 0),
+				u->kicks + v->kicks, insert_failed,
+				(int)(host_lookups > 0 ? ctx->metric_shards[i].host_cache_hits * 100 / host_lookups : 0));
 		sprintf(p, "%s", buf2);
 		p += strlen(buf2);
 	}
-	*/
 
-	sent_last = ctx->metric_sent;
-	getfailed_last = ctx->metric_getfailed;
-	ignored_last = ctx->metric_ignored;
+	sent_last = sum.metric_sent;
+	getfailed_last = sum.metric_getfailed;
+	ignored_last = sum.metric_ignored;
+	int port_printed[PORT_MAX] = {0};
 	for (int i = 0; i < ctx->core_num; i++) {
 		for (int j = 0; j < ctx->cores[i].port_num; j++) {
 			struct rte_eth_stats stats;
+			if (port_printed[ctx->cores[i].ports[j].index]) {
+				continue;
+			}
+			port_printed[ctx->cores[i].ports[j].index] = 1;
 			rte_eth_stats_get(ctx->cores[i].ports[j].index, &stats);
 			sprintf(buf2, " [%d] imissed = %8ld rx_nombuf = %8ld ",
 					ctx->cores[i].ports[j].index,
@@ -668,12 +989,13 @@ check_and_reload_tables(struct dpdkflow_context *ctx)
 	if (mrt_rib_updated(ctx)) {
 		mrt_rib_load(ctx);
 	}
+	mrt_update_apply(ctx);
 	if (app_table_updated(ctx)) {
 		app_table_load(ctx);
 	}
 }
 
-void
+int
 context_init(struct dpdkflow_context *ctx)
 {
 	uint64_t t1, t2;
@@ -681,16 +1003,50 @@ context_init(struct dpdkflow_context *ctx)
 	sleep(1);
 	t2 = rte_rdtsc();
 	ctx->tsc1s = t2 - t1;
+	clock_context_init(ctx);
 
-	ctx->metric_sent = 0;
-	ctx->metric_alloced = 0;
-	ctx->metric_getfailed = 0;
-	ctx->metric_ignored = 0;
-	rte_rwlock_init(&ctx->metric_stats_lock);
+	ctx->stats = rte_zmalloc("stats",
+			sizeof(struct dpdkflow_stats) * (ctx->core_num + 1), RTE_CACHE_LINE_SIZE);
+	if (ctx->stats == NULL) {
+		printf("context_init: stats alloc failed\n");
+		return -1;
+	}
 
+	ctx->export_batch = rte_zmalloc("export_batch",
+			sizeof(struct dpdkflow_metric) * EXPORT_BATCH_SIZE, RTE_CACHE_LINE_SIZE);
+	if (ctx->export_batch == NULL) {
+		printf("context_init: export_batch alloc failed\n");
+		return -1;
+	}
+	ctx->export_batch_num = 0;
+
+	ctx->rcu = rte_zmalloc("rcu", rte_rcu_qsbr_get_memsize(ctx->core_num), RTE_CACHE_LINE_SIZE);
+	if (ctx->rcu == NULL) {
+		printf("context_init: rcu alloc failed\n");
+		return -1;
+	}
+	if (rte_rcu_qsbr_init(ctx->rcu, ctx->core_num) != 0) {
+		printf("context_init: rte_rcu_qsbr_init failed\n");
+		return -1;
+	}
+
+	/* 集約キーを変えることがあるので、メトリックを作ったり読み戻したりする前に呼ぶ。 */
+	if (ipfix_context_init(ctx) != 0) {
+		return -1;
+	}
 	mrt_rib_context_init(ctx);
 	app_table_context_init(ctx);
-	metric_context_init(ctx);
+	if (metric_context_init(ctx) != 0) {
+		return -1;
+	}
+	if (topk_context_init(ctx) != 0) {
+		return -1;
+	}
+	if (checkpoint_restore(ctx) != 0) {
+		return -1;
+	}
+
+	return 0;
 }
 
 int
@@ -698,7 +1054,7 @@ start(struct dpdkflow_context *ctx)
 {
 	int ret;
 	int argc;
-	char *argv[3];
+	char *argv[3 + EAL_ARGS_MAX];
 	char cores_str[32];
 
 	printf("start: beg\n");
@@ -714,6 +1070,9 @@ start(struct dpdkflow_context *ctx)
 	argv[0] = "dpdkflow_cgo";
 	argv[1] = "-l";
 	argv[2] = cores_str;
+	for (int i = 0; i < ctx->eal_args_num; i++) {
+		argv[argc++] = ctx->eal_args[i];
+	}
 	ret = rte_eal_init(argc, argv);
 	if (ret < 0) {
 		printf("start: rte_eal_init failed: %d\n", ret);
@@ -730,8 +1089,10 @@ start(struct dpdkflow_context *ctx)
 		return -1;
 	}
 
+	unsigned int mbufs = mbuf_num(ctx);
+	printf("start: mbuf_num = %u\n", mbufs);
 	ctx->mbuf_pool = rte_pktmbuf_pool_create("mbuf_pool",
-			NUM_MBUFS, MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+			mbufs, MBUF_CACHE_SIZE, 0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
 	if (ctx->mbuf_pool == NULL) {
 		printf("start: mbuf_pool create failed\n");
 		return -1;
@@ -744,8 +1105,13 @@ start(struct dpdkflow_context *ctx)
 		return -1;
 	}
 
+	int port_inited[PORT_MAX] = {0};
 	for (int i = 0; i < ctx->core_num; i++) {
 		for (int j = 0; j < ctx->cores[i].port_num; j++) {
+			if (port_inited[ctx->cores[i].ports[j].index]) {
+				continue;
+			}
+			port_inited[ctx->cores[i].ports[j].index] = 1;
 			if (port_init(ctx, ctx->cores[i].ports[j].index) != 0) {
 				printf("start: port_init failed: core%d port%d\n",
 						ctx->cores[i].index, ctx->cores[i].ports[j].index);
@@ -754,7 +1120,10 @@ start(struct dpdkflow_context *ctx)
 		}
 	}
 
-	context_init(ctx);
+	if (context_init(ctx) != 0) {
+		printf("start: context_init failed\n");
+		return -1;
+	}
 
 	printf("start: rte_eal_remote_launch beg\n");
 	for (int i = 0; i < ctx->core_num; i++) {
@@ -767,8 +1136,15 @@ start(struct dpdkflow_context *ctx)
 
 	ctx->running = 1;
 
-	lcore_main(ctx);
+	int drain_pending = lcore_main(ctx);
 
+	rte_eal_mp_wait_lcore();
+	if (drain_pending) {
+		/* 書き込む lcore_flow がいなくなったので、切り替えの途中だったエポックを吐き出す。 */
+		metric_epoch_drain(ctx);
+	}
+	checkpoint_save(ctx);
+	ipfix_close(ctx);
 	rte_eal_cleanup();
 
 	printf("start: end\n");
@@ -16,24 +16,42 @@
 #include <rte_cycles.h>
 #include <rte_lcore.h>
 #include <rte_mbuf.h>
+#include <rte_prefetch.h>
+#include <rte_pause.h>
+#include <rte_hash_crc.h>
 #include <rte_ip_frag.h>
 #include <rte_rwlock.h>
+#include <rte_ring.h>
+#include <rte_malloc.h>
 #include <rte_lpm.h>
 #include <rte_lpm6.h>
+#include <rte_rcu_qsbr.h>
 
 #define CORE_MAX 8
 #define PORT_MAX 8
 #define VLAN_MAX 8
+#define QUEUE_MAX 16
+#define BURST_MAX 256
+#define METRIC_CACHE_SIZE (BURST_MAX * 2)
+#define EXPORT_BATCH_SIZE 4096
+#define IPFIX_MTU_MAX 9000
 #define LOCAL_NETS_MAX 8
+#define EAL_ARGS_MAX 16
+#define EAL_ARG_LEN 128
 extern const int8_t core_max;
 extern const int8_t port_max;
 extern const int8_t vlan_max;
+extern const int8_t queue_max;
+extern const uint16_t burst_max;
 extern const int8_t local_nets_max;
+extern const int8_t eal_args_max;
+extern const int16_t eal_arg_len;
 
 #define DIRECTION_INCOMING 1
 #define DIRECTION_OUTGOING 2
 #define DIRECTION_INTERNAL 3
 #define DIRECTION_EXTERNAL 4
+#define DIRECTION_NUM (DIRECTION_EXTERNAL + 1)
 extern const int8_t direction_incoming;
 extern const int8_t direction_outgoing;
 extern const int8_t direction_internal;
@@ -56,6 +74,26 @@ extern const uint32_t aggregate_f_src_port;
 extern const uint32_t aggregate_f_dst_port;
 extern const uint32_t aggregate_f_app;
 
+/* adaptive_aggregation でフローテーブルが埋まってきたときに集約キーを粗くする段階 */
+#define DEGRADE_PORTS 1    /* src_port, dst_port を app にまとめる */
+#define DEGRADE_PREFIX 2   /* src_host, dst_host を /24 (IPv6 は /48) にまとめる */
+#define DEGRADE_NO_HOST 3  /* src_host, dst_host を集約キーから外す */
+#define DEGRADE_MAX DEGRADE_NO_HOST
+extern const uint8_t degrade_max;
+
+static inline uint32_t
+degrade_flags(uint32_t flags, uint8_t degrade)
+{
+	if (degrade >= DEGRADE_PORTS && (flags & (aggregate_f_src_port | aggregate_f_dst_port))) {
+		flags &= ~(aggregate_f_src_port | aggregate_f_dst_port);
+		flags |= aggregate_f_app;
+	}
+	if (degrade >= DEGRADE_NO_HOST) {
+		flags &= ~(aggregate_f_src_host | aggregate_f_dst_host);
+	}
+	return flags;
+}
+
 #define APP_TABLE_HASH_SIZE 1024
 #define APP_DESC_LEN 44
 
@@ -69,34 +107,161 @@ struct dpdkflow_app_table {
 	struct dpdkflow_app_table_entry *app_table_hash_table[APP_TABLE_HASH_SIZE];
 };
 
-struct dpdkflow_metric {
+/*
+ * フローのキー。方向ごとの集約項目以外はマスクした状態でパケットごとに一度だけ作り、
+ * 固定長のままハッシュ・比較する。
+ */
+struct dpdkflow_metric_key {
+	uint8_t src_host[16];
+	uint8_t dst_host[16];
+	uint32_t src_as;
+	uint32_t dst_as;
+	int32_t vlan;
+	uint32_t app;
+	int32_t src_port;
+	int32_t dst_port;
 	int8_t iface;
 	int8_t direction;
 	uint8_t af;
 	uint8_t proto;
-	int32_t vlan;
-	uint8_t src_host[16];
-	uint8_t dst_host[16];
-	int64_t src_as;
-	int64_t dst_as;
-	int src_port;
-	int dst_port;
-	uint32_t app;
+	uint8_t overflow;
+	uint8_t degrade;
+	uint8_t reserved[2];
+} __attribute__((__aligned__(16)));
+
+struct dpdkflow_metric {
+	struct dpdkflow_metric_key key;
 	char app_desc[APP_DESC_LEN];
 	uint64_t packets;
 	uint64_t bytes;
 
 	uint64_t start_time;
 	uint64_t stop_time;
-	struct dpdkflow_metric *hash_next;
-	struct dpdkflow_metric *list_next;
+	/* topk モードで追い出されたカウンタから引き継いだ分 */
+	uint64_t packets_error;
+	uint64_t bytes_error;
+};
+
+static inline int
+metric_key_equals(const struct dpdkflow_metric_key *k1, const struct dpdkflow_metric_key *k2)
+{
+	const uint64_t *a = (const uint64_t *)k1;
+	const uint64_t *b = (const uint64_t *)k2;
+	uint64_t diff = 0;
+	for (int i = 0; i < sizeof(struct dpdkflow_metric_key) / sizeof(uint64_t); i++) {
+		diff |= a[i] ^ b[i];
+	}
+	return diff == 0;
+}
+
+#define METRIC_TABLE_BUCKET_ENTRIES 6
+
+struct dpdkflow_metric_bucket {
+	uint16_t sigs[METRIC_TABLE_BUCKET_ENTRIES];
+	uint32_t reserved;
+	struct dpdkflow_metric *metrics[METRIC_TABLE_BUCKET_ENTRIES];
+} __rte_cache_aligned;
+
+struct dpdkflow_metric_table {
+	struct dpdkflow_metric_bucket *buckets;
+	uint32_t bucket_mask;
+	uint32_t slots;
+	uint32_t entries;
+	uint64_t lookups;
+	uint64_t lookups_alt;
+	uint64_t kicks;
+	uint64_t insert_failed;
+};
+
+#define TOPK_CAPACITY_FACTOR 4
+
+#define HOST_CACHE_SIZE 4096
+/* バースト内のすべてのパケットで送信元と宛先を引く場合の数。 */
+#define HOST_LOOKUP_MAX (BURST_MAX * 2)
+
+/* 送信元と宛先のアドレスの組から引いた方向と AS 番号。 generation が 0 なら空。 */
+struct dpdkflow_host_cache_entry {
+	uint8_t src_host[16];
+	uint8_t dst_host[16];
+	uint32_t src_as;
+	uint32_t dst_as;
+	uint32_t generation;
+	uint8_t af;
+	int8_t direction;
+	uint8_t reserved[2];
+};
+
+/* lcore_flow がパケットのヘッダから取り出した値。 direction と AS 番号はバーストごとにまとめて求める。 */
+struct dpdkflow_packet {
+	uint8_t src_host[16];
+	uint8_t dst_host[16];
+	uint32_t bytes;
+	uint32_t src_as;
+	uint32_t dst_as;
+	int32_t vlan;
+	int src_port;
+	int dst_port;
+	int8_t iface;
+	int8_t direction;
+	uint8_t af;
+	uint8_t proto;
+};
+
+struct dpdkflow_topk_entry {
+	struct dpdkflow_metric metric;
+	uint32_t hash;
+	uint32_t heap_index;
 };
 
+struct dpdkflow_topk {
+	struct dpdkflow_topk_entry *entries;
+	uint32_t *heap;
+	uint32_t num;
+	uint32_t capacity;
+	struct dpdkflow_metric_table table;
+};
+
+/*
+ * lcore_flow ごとに持つフローテーブル。
+ * テーブルは metric_epoch の偶奇で 2 面を切り替える。使用中の面は持ち主の lcore_flow だけが触り、
+ * lcore_main はエポックが進んで使われなくなった面を吐き出すのでロックは不要。
+ * metric_cache は新しいフロー用に metric_pool からまとめて確保しておいたもの。
+ */
+struct dpdkflow_metric_shard {
+	struct dpdkflow_metric_table metric_tables[2];
+	struct dpdkflow_topk topk[2][DIRECTION_NUM];
+	/* エントリを確保できなかったパケットを方向・AF・ポートごとにまとめるところ */
+	struct dpdkflow_metric metric_overflow[2][DIRECTION_NUM][2][PORT_MAX];
+	/* このエポックで使っている集約キーの粗さ。エポックが変わると 0 に戻る。 */
+	uint8_t metric_degrade;
+	volatile uint32_t metric_epoch;
+	struct dpdkflow_metric *metric_cache[METRIC_CACHE_SIZE];
+	uint32_t metric_cache_num;
+	/* アドレスの組ごとの方向と AS 番号。ハッシュで 1 か所に決まり、衝突したら上書きする。 */
+	struct dpdkflow_host_cache_entry host_cache[HOST_CACHE_SIZE];
+	uint64_t host_cache_hits;
+	uint64_t host_cache_misses;
+} __rte_cache_aligned;
+
+/*
+ * lcore ごとの統計カウンタ。持ち主の lcore だけが書き込み、読む側で合計する。
+ * flow 用の lcore は cores と同じ順に並び、最後が main の lcore 。
+ */
+struct dpdkflow_stats {
+	uint64_t metric_alloced;
+	uint64_t metric_freed;
+	uint64_t metric_getfailed;
+	uint64_t metric_sent;
+	uint64_t metric_ignored;
+} __rte_cache_aligned;
+
 struct dpdkflow_context_port {
 	uint8_t index;
 	int32_t port_vlan_id;
 	int32_t tag_vlan_ids[VLAN_MAX];
 	int tag_vlan_num;
+	uint16_t queues[QUEUE_MAX];
+	int queue_num;
 };
 
 struct dpdkflow_context_core {
@@ -106,16 +271,87 @@ struct dpdkflow_context_core {
 	uint8_t port_num;
 };
 
+/*
+ * TSC から壁時計(マイクロ秒)への変換。
+ * usec = usec_base + ((tsc - tsc_base) * mult) >> 32
+ * 書き換え中は seq が奇数になる。
+ */
+struct dpdkflow_clock {
+	uint32_t seq;
+	uint64_t tsc_base;
+	uint64_t usec_base;
+	uint64_t mult;
+	uint64_t tsc_hz;
+	uint64_t calibrated_tsc;
+	uint64_t calibrated_usec;
+};
+
+/* IPFIX で書き出すときの状態。 lcore_main だけが触る。 */
+struct dpdkflow_ipfix {
+	int fd;
+	int is_file;
+	uint16_t mtu;
+	uint32_t domain_id;
+	uint32_t sequence;
+	uint16_t record_len_ipv4;
+	uint16_t record_len_ipv6;
+	uint8_t templates[256];
+	uint16_t templates_len;
+	time_t template_time;
+	uint8_t buf[IPFIX_MTU_MAX];
+	uint16_t len;
+	uint16_t set_offset;
+	uint16_t set_id;
+	uint32_t records;
+	uint64_t messages_sent;
+	uint64_t records_sent;
+	uint64_t send_failed;
+};
+
+/* mrt_peer_filter のビット */
+#define MRT_PEER_IPV4 0x01
+#define MRT_PEER_IPV6 0x02
+
+/* MRT のファイルを読んで LPM に反映するときの状態 */
+struct mrt_rib_loader {
+	struct rte_lpm *lpm_ipv4;
+	struct rte_lpm6 *lpm_ipv6;
+	/*
+	 * 使用中のテーブルを書き換えるときの RCU 。新しく作ったテーブルなら NULL 。
+	 * NULL でなければ UPDATE の追加と削除は ops にためておき、 mrt_update_commit でまとめて反映する。
+	 */
+	struct rte_rcu_qsbr *rcu;
+	struct mrt_update_op *ops;
+	uint32_t ops_num;
+	uint32_t ops_max;
+	/* mrt_peers で選んだセッションのアドレス。 peer_filter が 0 ならすべてのピアの経路を使う。 */
+	uint8_t peer_filter;
+	uint8_t peer_ipv4[4];
+	uint8_t peer_ipv6[16];
+	/* 直前の PEER_INDEX_TABLE で選んだピアの番号のビットマップ */
+	uint8_t peer_index_match[65536 / 8];
+	uint64_t records;
+	uint64_t prefixes;
+	uint64_t withdrawals;
+	uint64_t bytes;
+};
+
 struct dpdkflow_context {
+	/* Go から書かれる。lcore 側の待ちループで消されないよう __atomic_load_n で読む。 */
 	int done;
 	int running;
 	uint64_t tsc1s;
+	struct dpdkflow_clock clock;
 
 	int main_core_index;
 	int interval;
+	int interval_align;
 	uint32_t metrics_num;
 	uint32_t thresh_packets;
 	uint32_t thresh_bytes;
+	uint32_t topk;
+	int adaptive_aggregation;
+	uint16_t rx_burst_size;
 	uint8_t local_nets_ipv4_pfix[LOCAL_NETS_MAX][16];
 	uint8_t local_nets_ipv4_plen[LOCAL_NETS_MAX];
 	uint8_t local_nets_ipv4_num;
@@ -126,6 +362,10 @@ struct dpdkflow_context {
 	uint32_t aggregate_flags_outgoing;
 	uint32_t aggregate_flags_internal;
 	uint32_t aggregate_flags_external;
+	/* src_host, dst_host を集約するときのプレフィクス長。 [方向][src, dst][IPv4, IPv6] */
+	uint8_t host_plen[DIRECTION_NUM][2][2];
+	char eal_args[EAL_ARGS_MAX][EAL_ARG_LEN];
+	int eal_args_num;
 
 	struct dpdkflow_context_core cores[CORE_MAX];
 	uint8_t core_num;
@@ -133,11 +373,17 @@ struct dpdkflow_context {
 	struct rte_mempool *mbuf_pool;
 	struct rte_mempool *metric_pool;
 
-	uint64_t metric_sent;
-	uint64_t metric_alloced;
-	uint64_t metric_getfailed;
-	uint64_t metric_ignored;
-	rte_rwlock_t metric_stats_lock;
+	struct dpdkflow_stats *stats;
+
+	/*
+	 * mrt_rib と app_table の差し替え用。 lcore_flow がループごとに静止状態を報告し、
+	 * 差し替えた側はすべての lcore_flow が報告するのを待ってから古いテーブルを捨てる。
+	 */
+	struct rte_rcu_qsbr *rcu;
+
+	/* lcore_main が Go にまとめて渡すメトリックの写し */
+	struct dpdkflow_metric *export_batch;
+	int export_batch_num;
 
 	/* mrt_rib */
 	char mrt_rib_path[256];
@@ -145,26 +391,69 @@ struct dpdkflow_context {
 	uint32_t mrt_rib_table_ipv4_seq;
 	struct rte_lpm6 *mrt_rib_table_ipv6;
 	uint32_t mrt_rib_table_ipv6_seq;
-	rte_rwlock_t mrt_rib_lock;
+	/* mrt_rib を差し替えたり書き換えたりするたびに進め、 host_cache を無効にする。 */
+	uint32_t host_cache_generation;
 	struct timespec mrt_rib_last_mtim;
+	char mrt_update_dir[256];
+	uint8_t mrt_peer_filter;
+	uint8_t mrt_peer_ipv4[4];
+	uint8_t mrt_peer_ipv6[16];
+	struct timespec mrt_update_last_mtim;
 
 	/* app_table */
 	struct dpdkflow_app_table *app_table;
-	rte_rwlock_t app_table_lock;
 	struct timespec protocols_last_mtim;
 	struct timespec services_last_mtim;
 
 	/* metric */
-	struct dpdkflow_metric **metric_hash_table;
-	struct dpdkflow_metric *metric_list_head;
-	struct dpdkflow_metric *metric_list_tail;
-	rte_rwlock_t metric_lock;
+	struct dpdkflow_metric_shard *metric_shards;
+	struct dpdkflow_metric_table metric_merge_table;
+	volatile uint32_t metric_epoch;
+	uint64_t metric_epoch_start;
+	uint64_t metric_epoch_end;
+	uint64_t metric_export_time;
+
+	/* topk */
+	struct dpdkflow_metric **topk_candidates;
+
+	/* checkpoint */
+	char checkpoint_path[256];
+
+	/* ipfix */
+	char ipfix_export[256];
+	uint16_t ipfix_mtu;
+	uint32_t ipfix_domain_id;
+	struct dpdkflow_ipfix *ipfix;
 };
 
+/* dpdkflow_checkpoint.c */
+extern int checkpoint_save(struct dpdkflow_context *ctx);
+extern int checkpoint_restore(struct dpdkflow_context *ctx);
+
+/* dpdkflow_clock.c */
+extern uint64_t clock_tsc_to_usec(struct dpdkflow_context *ctx, uint64_t tsc);
+extern void clock_snapshot(struct dpdkflow_context *ctx, uint64_t *tsc_base, uint64_t *usec_base, uint64_t *mult);
+extern uint64_t clock_now(struct dpdkflow_context *ctx);
+extern void clock_calibrate(struct dpdkflow_context *ctx);
+extern void clock_calibrate_if_needed(struct dpdkflow_context *ctx);
+extern void clock_context_init(struct dpdkflow_context *ctx);
+
+/* dpdkflow_mrt_update.c */
+extern void mrt_update_parse(uint8_t *buf, size_t len, uint16_t type, uint16_t subtype, struct mrt_rib_loader *l);
+extern void mrt_update_apply(struct dpdkflow_context *ctx);
+extern int mrt_update_load(struct dpdkflow_context *ctx, const char *path, struct mrt_rib_loader *l);
+
 /* dpdkflow_mrt_rib.c */
-extern uint32_t mrt_rib_lookup(struct dpdkflow_context *ctx, uint8_t af, uint8_t *addr);
+extern void mrt_rib_lookup_bulk(struct dpdkflow_context *ctx, uint8_t af, uint8_t addrs[][16],
+		uint32_t *as_nums, int n);
 extern int mrt_rib_updated(struct dpdkflow_context *ctx);
 extern int mrt_rib_load(struct dpdkflow_context *ctx);
+extern void mrt_rib_table_add_ipv4(struct rte_lpm *lpm4, uint8_t *prefix, uint8_t prefix_len, uint32_t as_num);
+extern void mrt_rib_table_add_ipv6(struct rte_lpm6 *lpm6, uint8_t *prefix, uint8_t prefix_len, uint32_t as_num);
+extern uint32_t parse_as_path_attrs(uint8_t *buf, int len, int as_size);
+extern int mrt_rib_load_file(const char *path, struct mrt_rib_loader *l);
+extern void mrt_rib_loader_peers(struct mrt_rib_loader *l, struct dpdkflow_context *ctx);
+extern int mrt_rib_peer_match(struct mrt_rib_loader *l, int ipv6, uint8_t *addr);
 extern void mrt_rib_context_init(struct dpdkflow_context *ctx);
 
 /* dpdkflow_app_table.c */
@@ -173,16 +462,59 @@ extern int app_table_updated(struct dpdkflow_context *ctx);
 extern int app_table_load(struct dpdkflow_context *ctx);
 extern void app_table_context_init(struct dpdkflow_context *ctx);
 
+/* dpdkflow_metric_table.c */
+extern struct dpdkflow_metric *metric_table_lookup(struct dpdkflow_metric_table *t,
+		struct dpdkflow_metric *m, uint32_t hash);
+extern void metric_table_lookup_bulk(struct dpdkflow_metric_table *t, struct dpdkflow_metric *metrics,
+		uint32_t *hashes, int *valid, int n, struct dpdkflow_metric **found);
+extern int metric_table_insert(struct dpdkflow_metric_table *t, struct dpdkflow_metric *m, uint32_t hash);
+extern void metric_table_remove(struct dpdkflow_metric_table *t, struct dpdkflow_metric *m, uint32_t hash);
+extern void metric_table_reset(struct dpdkflow_metric_table *t);
+extern void metric_table_drain(struct dpdkflow_metric_table *t,
+		void (*fn)(struct dpdkflow_context *ctx, struct dpdkflow_metric *m), struct dpdkflow_context *ctx);
+extern int metric_table_init(struct dpdkflow_metric_table *t, const char *name, uint32_t capacity);
+
+/* dpdkflow_topk.c */
+extern void topk_update(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard,
+		struct dpdkflow_metric *m, uint32_t hash);
+extern void topk_drain(struct dpdkflow_context *ctx);
+extern int topk_context_init(struct dpdkflow_context *ctx);
+
+/* dpdkflow_ipfix.c */
+extern void ipfix_add(struct dpdkflow_ipfix *ipfix, struct dpdkflow_metric *m);
+extern void ipfix_flush(struct dpdkflow_ipfix *ipfix);
+extern void ipfix_close(struct dpdkflow_context *ctx);
+extern int ipfix_context_init(struct dpdkflow_context *ctx);
+
 /* dpdkflow_metric.c */
-extern int metric_deq(struct dpdkflow_context *ctx, struct dpdkflow_metric **mbuf, int mbuf_size);
-extern void metric_update(struct dpdkflow_context *ctx, struct dpdkflow_metric *m, int *stored);
+extern void metric_epoch_sync(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard);
+extern int metric_epoch_expired(struct dpdkflow_context *ctx, uint64_t current_time);
+extern void metric_epoch_begin(struct dpdkflow_context *ctx, uint64_t current_time);
+extern int metric_epoch_flip(struct dpdkflow_context *ctx, uint64_t current_time);
+extern void metric_epoch_drain(struct dpdkflow_context *ctx);
+extern uint32_t metric_hash(struct dpdkflow_metric *m);
+extern void metric_merge(struct dpdkflow_metric *dst, struct dpdkflow_metric *src);
+extern int metric_insert(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard,
+		struct dpdkflow_metric *m, uint32_t hash);
+extern void metric_overflow(struct dpdkflow_metric_shard *shard, struct dpdkflow_metric *m);
+extern void metric_degrade_update(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard);
+extern void metric_cache_fill(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard, uint32_t n);
+extern struct dpdkflow_metric *metric_cache_get(struct dpdkflow_metric_shard *shard);
+extern struct dpdkflow_metric_table *metric_shard_table(struct dpdkflow_metric_shard *shard);
 extern void metric_print(struct dpdkflow_metric *m);
 extern void metric_init(struct dpdkflow_metric *m);
-extern void metric_context_init(struct dpdkflow_context *ctx);
+extern int metric_context_init(struct dpdkflow_context *ctx);
 
 /* dpdkflow_cgo.c */
 extern uint64_t now();
 extern int aggregate_flag_up(struct dpdkflow_context *ctx, int8_t direction, uint32_t aggregate_f);
+extern uint32_t aggregate_flags(struct dpdkflow_context *ctx, int8_t direction);
+extern void host_mask(uint8_t *host, uint8_t af, int plen);
+extern void metric_export_append(struct dpdkflow_context *ctx, struct dpdkflow_metric *m);
+extern void metric_export_record(struct dpdkflow_context *ctx, struct dpdkflow_metric *m);
+extern void metric_export(struct dpdkflow_context *ctx, struct dpdkflow_metric *m);
+extern void metric_export_flush(struct dpdkflow_context *ctx);
+extern void stats_sum(struct dpdkflow_context *ctx, struct dpdkflow_stats *sum);
 extern void print_stats(struct dpdkflow_context *ctx);
 extern int check_and_reload_tables(struct dpdkflow_context *ctx);
 extern int start(struct dpdkflow_context *ctx);
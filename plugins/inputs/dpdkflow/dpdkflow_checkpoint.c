@@ -0,0 +1,245 @@
+#include "dpdkflow_cgo.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/*
+ * 停止時に集計途中のフローをファイルに書き出し、次の start で読み戻す。
+ * ファイルはヘッダのあとに struct dpdkflow_metric をそのまま並べたもので、
+ * 書き出しも読み戻しも mmap した領域との memcpy だけで済ませる。
+ * 構造体の形が変わったときに読み違えないよう、ヘッダに大きさを入れて確かめる。
+ * 集約キーの設定が変わったときも古いキーのフローを混ぜないよう、設定のハッシュを入れて確かめる。
+ */
+
+#define CHECKPOINT_MAGIC "DPFLOWCP"
+#define CHECKPOINT_VERSION 2
+
+struct dpdkflow_checkpoint_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t metric_size;
+	uint64_t num;
+	uint64_t saved_time;
+	uint32_t config_hash;
+	uint32_t reserved;
+};
+
+/* キーの作り方を決める設定。 ipfix_context_init が足す af も含める。 */
+static uint32_t
+checkpoint_config_hash(struct dpdkflow_context *ctx)
+{
+	uint32_t flags[DIRECTION_NUM] = {
+		[DIRECTION_INCOMING] = ctx->aggregate_flags_incoming,
+		[DIRECTION_OUTGOING] = ctx->aggregate_flags_outgoing,
+		[DIRECTION_INTERNAL] = ctx->aggregate_flags_internal,
+		[DIRECTION_EXTERNAL] = ctx->aggregate_flags_external,
+	};
+	uint32_t hash = rte_hash_crc(flags, sizeof(flags), 0);
+	return rte_hash_crc(ctx->host_plen, sizeof(ctx->host_plen), hash);
+}
+
+static uint64_t
+checkpoint_count(struct dpdkflow_context *ctx)
+{
+	uint64_t num = 0;
+	int overflow_num = 2 * DIRECTION_NUM * 2 * PORT_MAX;
+	for (int i = 0; i < ctx->core_num; i++) {
+		struct dpdkflow_metric_shard *shard = &ctx->metric_shards[i];
+		num += shard->metric_tables[0].entries + shard->metric_tables[1].entries;
+		for (int j = 0; j < overflow_num; j++) {
+			if ((&shard->metric_overflow[0][0][0][0])[j].packets > 0) {
+				num++;
+			}
+		}
+	}
+	return num;
+}
+
+static struct dpdkflow_metric *
+checkpoint_copy_table(struct dpdkflow_metric_table *t, struct dpdkflow_metric *dst)
+{
+	for (uint32_t i = 0; i <= t->bucket_mask; i++) {
+		struct dpdkflow_metric_bucket *b = &t->buckets[i];
+		for (int j = 0; j < METRIC_TABLE_BUCKET_ENTRIES; j++) {
+			if (b->metrics[j] != NULL) {
+				*dst++ = *b->metrics[j];
+			}
+		}
+	}
+	return dst;
+}
+
+/*
+ * lcore_flow がすべて止まってから呼ぶ。
+ * 途中で止まっても前のファイルを壊さないよう、一時ファイルに書いてから rename する。
+ * topk モードのカウンタは書き出さない。
+ */
+int
+checkpoint_save(struct dpdkflow_context *ctx)
+{
+	char tmp_path[sizeof(ctx->checkpoint_path) + 4];
+	struct dpdkflow_checkpoint_header *header;
+	struct dpdkflow_metric *dst;
+	uint64_t num;
+	size_t size;
+	void *addr;
+	int fd;
+	int ret;
+	int overflow_num = 2 * DIRECTION_NUM * 2 * PORT_MAX;
+
+	if (ctx->checkpoint_path[0] == '\0' || ctx->metric_shards == NULL) {
+		return 0;
+	}
+	num = checkpoint_count(ctx);
+	size = sizeof(struct dpdkflow_checkpoint_header) + sizeof(struct dpdkflow_metric) * num;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ctx->checkpoint_path);
+	fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("checkpoint_save: open failed: %s\n", tmp_path);
+		return -1;
+	}
+	/* 疎なファイルのままだと、ディスクが足りないときに mmap した領域への書き込みで SIGBUS になる。 */
+	ret = posix_fallocate(fd, 0, size);
+	if (ret != 0) {
+		printf("checkpoint_save: posix_fallocate failed: %s: %s\n", tmp_path, strerror(ret));
+		close(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		printf("checkpoint_save: mmap failed: %s\n", tmp_path);
+		close(fd);
+		return -1;
+	}
+
+	header = addr;
+	memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+	header->version = CHECKPOINT_VERSION;
+	header->metric_size = sizeof(struct dpdkflow_metric);
+	header->num = num;
+	header->saved_time = clock_now(ctx);
+	header->config_hash = checkpoint_config_hash(ctx);
+	dst = (struct dpdkflow_metric *)(header + 1);
+	for (int i = 0; i < ctx->core_num; i++) {
+		struct dpdkflow_metric_shard *shard = &ctx->metric_shards[i];
+		dst = checkpoint_copy_table(&shard->metric_tables[0], dst);
+		dst = checkpoint_copy_table(&shard->metric_tables[1], dst);
+		for (int j = 0; j < overflow_num; j++) {
+			struct dpdkflow_metric *o = &shard->metric_overflow[0][0][0][0] + j;
+			if (o->packets > 0) {
+				*dst++ = *o;
+			}
+		}
+	}
+
+	msync(addr, size, MS_SYNC);
+	munmap(addr, size);
+	close(fd);
+	if (rename(tmp_path, ctx->checkpoint_path) != 0) {
+		printf("checkpoint_save: rename failed: %s\n", ctx->checkpoint_path);
+		return -1;
+	}
+	printf("checkpoint_save: %lu metrics saved to %s\n", num, ctx->checkpoint_path);
+	return 0;
+}
+
+static void
+checkpoint_restore_metric(struct dpdkflow_context *ctx, struct dpdkflow_metric *src, uint64_t *dropped)
+{
+	struct dpdkflow_metric *m;
+	uint32_t hash = metric_hash(src);
+	/* 同じキーが同じ lcore_flow に集まるようハッシュで振り分ける。 */
+	struct dpdkflow_metric_shard *shard = &ctx->metric_shards[hash % ctx->core_num];
+	struct dpdkflow_metric_table *t = metric_shard_table(shard);
+
+	if (src->key.overflow) {
+		metric_overflow(shard, src);
+		return;
+	}
+	m = metric_table_lookup(t, src, hash);
+	if (m != NULL) {
+		metric_merge(m, src);
+		return;
+	}
+	if (rte_mempool_get(ctx->metric_pool, (void **)&m) < 0) {
+		/* フローのデータを割り当てられないときは受信時と同じくあふれ用に足し込む。 */
+		metric_overflow(shard, src);
+		(*dropped)++;
+		return;
+	}
+	*m = *src;
+	if (metric_table_insert(t, m, hash) != 0) {
+		rte_mempool_put(ctx->metric_pool, (void *)m);
+		metric_overflow(shard, src);
+		(*dropped)++;
+		return;
+	}
+	ctx->stats[ctx->core_num].metric_alloced++;
+}
+
+/*
+ * metric_context_init のあとに呼ぶ。読み戻したフローは最初の interval の終わりに
+ * 新しく受信したものと一緒に出力される。同じものを 2 度読まないようファイルは消す。
+ */
+int
+checkpoint_restore(struct dpdkflow_context *ctx)
+{
+	struct dpdkflow_checkpoint_header *header;
+	struct dpdkflow_metric *src;
+	struct stat st;
+	uint64_t dropped = 0;
+	void *addr;
+	int fd;
+
+	printf("checkpoint_restore\n");
+
+	if (ctx->checkpoint_path[0] == '\0') {
+		return 0;
+	}
+	fd = open(ctx->checkpoint_path, O_RDONLY);
+	if (fd < 0) {
+		/* 初めて起動したときなど */
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct dpdkflow_checkpoint_header)) {
+		printf("checkpoint_restore: invalid file: %s\n", ctx->checkpoint_path);
+		close(fd);
+		unlink(ctx->checkpoint_path);
+		return 0;
+	}
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		printf("checkpoint_restore: mmap failed: %s\n", ctx->checkpoint_path);
+		return 0;
+	}
+	madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+	header = addr;
+	if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0
+	 || header->version != CHECKPOINT_VERSION
+	 || header->metric_size != sizeof(struct dpdkflow_metric)
+	 || (uint64_t)st.st_size != sizeof(struct dpdkflow_checkpoint_header)
+			+ header->num * sizeof(struct dpdkflow_metric)) {
+		printf("checkpoint_restore: incompatible file: %s\n", ctx->checkpoint_path);
+		goto out;
+	}
+	if (header->config_hash != checkpoint_config_hash(ctx)) {
+		printf("checkpoint_restore: aggregate config changed, discarded: %s\n", ctx->checkpoint_path);
+		goto out;
+	}
+	src = (struct dpdkflow_metric *)(header + 1);
+	for (uint64_t i = 0; i < header->num; i++) {
+		checkpoint_restore_metric(ctx, &src[i], &dropped);
+	}
+	printf("checkpoint_restore: %lu metrics restored from %s (%lu overflowed, %lu sec old)\n",
+			header->num, ctx->checkpoint_path, dropped,
+			(clock_now(ctx) - header->saved_time) / 1000000);
+out:
+	/* 読めないファイルで起動を止めることはしない。 */
+	munmap(addr, st.st_size);
+	unlink(ctx->checkpoint_path);
+	return 0;
+}
@@ -0,0 +1,107 @@
+#include "dpdkflow_cgo.h"
+
+#define CLOCK_CALIBRATE_INTERVAL 1000000
+
+static inline uint64_t
+clock_convert(uint64_t tsc, uint64_t tsc_base, uint64_t usec_base, uint64_t mult)
+{
+	if (tsc < tsc_base) {
+		return usec_base;
+	}
+	return usec_base + (uint64_t)(((unsigned __int128)(tsc - tsc_base) * mult) >> 32);
+}
+
+static inline void
+clock_read(struct dpdkflow_context *ctx, uint64_t *tsc_base, uint64_t *usec_base, uint64_t *mult)
+{
+	volatile struct dpdkflow_clock *clock = &ctx->clock;
+	uint32_t seq;
+	do {
+		seq = clock->seq;
+		rte_smp_rmb();
+		*tsc_base = clock->tsc_base;
+		*usec_base = clock->usec_base;
+		*mult = clock->mult;
+		rte_smp_rmb();
+	} while ((seq & 1) || seq != clock->seq);
+}
+
+uint64_t
+clock_tsc_to_usec(struct dpdkflow_context *ctx, uint64_t tsc)
+{
+	uint64_t tsc_base, usec_base, mult;
+	clock_read(ctx, &tsc_base, &usec_base, &mult);
+	return clock_convert(tsc, tsc_base, usec_base, mult);
+}
+
+/* Go から変換に使う値を読む。 lcore_main が較正している最中でも揃った組を返す。 */
+void
+clock_snapshot(struct dpdkflow_context *ctx, uint64_t *tsc_base, uint64_t *usec_base, uint64_t *mult)
+{
+	clock_read(ctx, tsc_base, usec_base, mult);
+}
+
+uint64_t
+clock_now(struct dpdkflow_context *ctx)
+{
+	return clock_tsc_to_usec(ctx, rte_rdtsc());
+}
+
+void
+clock_calibrate(struct dpdkflow_context *ctx)
+{
+	volatile struct dpdkflow_clock *clock = &ctx->clock;
+	uint64_t tsc_base, usec_base, mult;
+	uint64_t tsc1, tsc2, tsc, wall, usec, tsc_hz;
+
+	tsc1 = rte_rdtsc();
+	wall = now();
+	tsc2 = rte_rdtsc();
+	tsc = tsc1 + ((tsc2 - tsc1) >> 1);
+
+	clock_read(ctx, &tsc_base, &usec_base, &mult);
+	tsc_hz = clock->tsc_hz;
+	if (clock->calibrated_tsc != 0 && wall > clock->calibrated_usec && tsc > clock->calibrated_tsc) {
+		/* 前回の較正からの経過時間で TSC の周波数を求め、急な変化はならす。 */
+		uint64_t measured_hz = (tsc - clock->calibrated_tsc) * 1000000 / (wall - clock->calibrated_usec);
+		tsc_hz = (tsc_hz * 7 + measured_hz) >> 3;
+	}
+	/* 時刻が巻き戻らないようにする。 */
+	uint64_t usec_cur = clock_convert(tsc, tsc_base, usec_base, mult);
+	usec = wall;
+	if (usec < usec_cur) {
+		usec = usec_cur;
+	}
+
+	clock->seq++;
+	rte_smp_wmb();
+	clock->tsc_base = tsc;
+	clock->usec_base = usec;
+	clock->mult = ((uint64_t)1000000 << 32) / tsc_hz;
+	clock->tsc_hz = tsc_hz;
+	rte_smp_wmb();
+	clock->seq++;
+
+	clock->calibrated_tsc = tsc;
+	clock->calibrated_usec = wall;
+}
+
+void
+clock_calibrate_if_needed(struct dpdkflow_context *ctx)
+{
+	if (clock_now(ctx) - ctx->clock.calibrated_usec >= CLOCK_CALIBRATE_INTERVAL) {
+		clock_calibrate(ctx);
+	}
+}
+
+void
+clock_context_init(struct dpdkflow_context *ctx)
+{
+	printf("clock_context_init\n");
+
+	memset(&ctx->clock, 0, sizeof(struct dpdkflow_clock));
+	ctx->clock.tsc_hz = ctx->tsc1s;
+	clock_calibrate(ctx);
+
+	printf("clock_context_init: tsc_hz = %lu\n", ctx->clock.tsc_hz);
+}
@@ -0,0 +1,385 @@
+#include "dpdkflow_cgo.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+
+/*
+ * IPFIX (RFC 7011) での書き出し。
+ * lcore_main が吐き出すメトリックを IPv4 用と IPv6 用のテンプレートでデータレコードにし、
+ * MTU に収まるだけまとめて UDP で送るかファイルに書く。
+ * テンプレートは最初に作っておき、 UDP のときは IPFIX_TEMPLATE_INTERVAL ごとに送り直す。
+ */
+
+#define IPFIX_VERSION 10
+#define IPFIX_HEADER_LEN 16
+#define IPFIX_SET_HEADER_LEN 4
+#define IPFIX_TEMPLATE_SET_ID 2
+#define IPFIX_TEMPLATE_ID_IPV4 256
+#define IPFIX_TEMPLATE_ID_IPV6 257
+#define IPFIX_TEMPLATE_INTERVAL 60
+
+/* 情報要素 ID */
+#define IPFIX_IE_OCTET_DELTA_COUNT 1
+#define IPFIX_IE_PACKET_DELTA_COUNT 2
+#define IPFIX_IE_PROTOCOL_IDENTIFIER 4
+#define IPFIX_IE_SOURCE_TRANSPORT_PORT 7
+#define IPFIX_IE_SOURCE_IPV4_ADDRESS 8
+#define IPFIX_IE_INGRESS_INTERFACE 10
+#define IPFIX_IE_DESTINATION_TRANSPORT_PORT 11
+#define IPFIX_IE_DESTINATION_IPV4_ADDRESS 12
+#define IPFIX_IE_BGP_SOURCE_AS_NUMBER 16
+#define IPFIX_IE_BGP_DESTINATION_AS_NUMBER 17
+#define IPFIX_IE_SOURCE_IPV6_ADDRESS 27
+#define IPFIX_IE_DESTINATION_IPV6_ADDRESS 28
+#define IPFIX_IE_VLAN_ID 58
+#define IPFIX_IE_FLOW_DIRECTION 61
+#define IPFIX_IE_FLOW_START_MILLISECONDS 152
+#define IPFIX_IE_FLOW_END_MILLISECONDS 153
+
+struct ipfix_field {
+	uint16_t id;
+	uint16_t len;
+};
+
+static const struct ipfix_field ipfix_fields_ipv4[] = {
+	{ IPFIX_IE_SOURCE_IPV4_ADDRESS, 4 },
+	{ IPFIX_IE_DESTINATION_IPV4_ADDRESS, 4 },
+	{ IPFIX_IE_SOURCE_TRANSPORT_PORT, 2 },
+	{ IPFIX_IE_DESTINATION_TRANSPORT_PORT, 2 },
+	{ IPFIX_IE_PROTOCOL_IDENTIFIER, 1 },
+	{ IPFIX_IE_FLOW_DIRECTION, 1 },
+	{ IPFIX_IE_VLAN_ID, 2 },
+	{ IPFIX_IE_INGRESS_INTERFACE, 4 },
+	{ IPFIX_IE_BGP_SOURCE_AS_NUMBER, 4 },
+	{ IPFIX_IE_BGP_DESTINATION_AS_NUMBER, 4 },
+	{ IPFIX_IE_PACKET_DELTA_COUNT, 8 },
+	{ IPFIX_IE_OCTET_DELTA_COUNT, 8 },
+	{ IPFIX_IE_FLOW_START_MILLISECONDS, 8 },
+	{ IPFIX_IE_FLOW_END_MILLISECONDS, 8 },
+};
+
+static const struct ipfix_field ipfix_fields_ipv6[] = {
+	{ IPFIX_IE_SOURCE_IPV6_ADDRESS, 16 },
+	{ IPFIX_IE_DESTINATION_IPV6_ADDRESS, 16 },
+	{ IPFIX_IE_SOURCE_TRANSPORT_PORT, 2 },
+	{ IPFIX_IE_DESTINATION_TRANSPORT_PORT, 2 },
+	{ IPFIX_IE_PROTOCOL_IDENTIFIER, 1 },
+	{ IPFIX_IE_FLOW_DIRECTION, 1 },
+	{ IPFIX_IE_VLAN_ID, 2 },
+	{ IPFIX_IE_INGRESS_INTERFACE, 4 },
+	{ IPFIX_IE_BGP_SOURCE_AS_NUMBER, 4 },
+	{ IPFIX_IE_BGP_DESTINATION_AS_NUMBER, 4 },
+	{ IPFIX_IE_PACKET_DELTA_COUNT, 8 },
+	{ IPFIX_IE_OCTET_DELTA_COUNT, 8 },
+	{ IPFIX_IE_FLOW_START_MILLISECONDS, 8 },
+	{ IPFIX_IE_FLOW_END_MILLISECONDS, 8 },
+};
+
+#define IPFIX_FIELDS_NUM(fields) (sizeof(fields) / sizeof(struct ipfix_field))
+
+static inline uint8_t *
+ipfix_put16(uint8_t *p, uint16_t v)
+{
+	*(uint16_t *)p = htons(v);
+	return p + 2;
+}
+
+static inline uint8_t *
+ipfix_put32(uint8_t *p, uint32_t v)
+{
+	*(uint32_t *)p = htonl(v);
+	return p + 4;
+}
+
+static inline uint8_t *
+ipfix_put64(uint8_t *p, uint64_t v)
+{
+	p = ipfix_put32(p, (uint32_t)(v >> 32));
+	return ipfix_put32(p, (uint32_t)v);
+}
+
+static uint16_t
+ipfix_record_len(const struct ipfix_field *fields, int num)
+{
+	uint16_t len = 0;
+	for (int i = 0; i < num; i++) {
+		len += fields[i].len;
+	}
+	return len;
+}
+
+static uint8_t *
+ipfix_put_template(uint8_t *p, uint16_t template_id, const struct ipfix_field *fields, int num)
+{
+	p = ipfix_put16(p, template_id);
+	p = ipfix_put16(p, num);
+	for (int i = 0; i < num; i++) {
+		p = ipfix_put16(p, fields[i].id);
+		p = ipfix_put16(p, fields[i].len);
+	}
+	return p;
+}
+
+/* テンプレートセットを作ってキャッシュしておく。 */
+static void
+ipfix_build_templates(struct dpdkflow_ipfix *ipfix)
+{
+	uint8_t *p = ipfix->templates + IPFIX_SET_HEADER_LEN;
+	p = ipfix_put_template(p, IPFIX_TEMPLATE_ID_IPV4, ipfix_fields_ipv4, IPFIX_FIELDS_NUM(ipfix_fields_ipv4));
+	p = ipfix_put_template(p, IPFIX_TEMPLATE_ID_IPV6, ipfix_fields_ipv6, IPFIX_FIELDS_NUM(ipfix_fields_ipv6));
+	ipfix->templates_len = p - ipfix->templates;
+	ipfix_put16(ipfix->templates, IPFIX_TEMPLATE_SET_ID);
+	ipfix_put16(ipfix->templates + 2, ipfix->templates_len);
+}
+
+static inline uint8_t
+ipfix_flow_direction(int8_t direction)
+{
+	/* incoming と outgoing は RFC の ingress(0), egress(1) 。ほかは IANA 未定義の値を使う。 */
+	switch (direction) {
+	case DIRECTION_INCOMING:
+		return 0;
+	case DIRECTION_OUTGOING:
+		return 1;
+	case DIRECTION_INTERNAL:
+		return 2;
+	case DIRECTION_EXTERNAL:
+		return 3;
+	}
+	return 0xff;
+}
+
+static void
+ipfix_close_set(struct dpdkflow_ipfix *ipfix)
+{
+	if (ipfix->set_offset == 0) {
+		return;
+	}
+	ipfix_put16(ipfix->buf + ipfix->set_offset + 2, ipfix->len - ipfix->set_offset);
+	ipfix->set_offset = 0;
+	ipfix->set_id = 0;
+}
+
+static void
+ipfix_begin_message(struct dpdkflow_ipfix *ipfix)
+{
+	ipfix->len = IPFIX_HEADER_LEN;
+	ipfix->records = 0;
+	if (ipfix->template_time == 0
+	 || (!ipfix->is_file && time(NULL) - ipfix->template_time >= IPFIX_TEMPLATE_INTERVAL)) {
+		memcpy(ipfix->buf + ipfix->len, ipfix->templates, ipfix->templates_len);
+		ipfix->len += ipfix->templates_len;
+		ipfix->template_time = time(NULL);
+	}
+}
+
+void
+ipfix_flush(struct dpdkflow_ipfix *ipfix)
+{
+	uint8_t *p = ipfix->buf;
+	ssize_t ret;
+	if (ipfix->records == 0) {
+		return;
+	}
+	ipfix_close_set(ipfix);
+	p = ipfix_put16(p, IPFIX_VERSION);
+	p = ipfix_put16(p, ipfix->len);
+	p = ipfix_put32(p, (uint32_t)time(NULL));
+	p = ipfix_put32(p, ipfix->sequence);
+	p = ipfix_put32(p, ipfix->domain_id);
+	if (ipfix->is_file) {
+		ret = write(ipfix->fd, ipfix->buf, ipfix->len);
+	} else {
+		ret = send(ipfix->fd, ipfix->buf, ipfix->len, 0);
+	}
+	if (ret != ipfix->len) {
+		ipfix->send_failed++;
+	} else {
+		ipfix->messages_sent++;
+		ipfix->records_sent += ipfix->records;
+	}
+	/* シーケンス番号はこれまでに送ったデータレコードの数 */
+	ipfix->sequence += ipfix->records;
+	ipfix_begin_message(ipfix);
+}
+
+void
+ipfix_add(struct dpdkflow_ipfix *ipfix, struct dpdkflow_metric *m)
+{
+	struct dpdkflow_metric_key *k = &m->key;
+	int ipv6 = (k->af == AF_IPV6);
+	uint16_t set_id = ipv6 ? IPFIX_TEMPLATE_ID_IPV6 : IPFIX_TEMPLATE_ID_IPV4;
+	uint16_t record_len = ipv6 ? ipfix->record_len_ipv6 : ipfix->record_len_ipv4;
+	uint16_t need = record_len + ((ipfix->set_id == set_id) ? 0 : IPFIX_SET_HEADER_LEN);
+	uint8_t *p;
+
+	if (ipfix->len + need > ipfix->mtu) {
+		ipfix_flush(ipfix);
+		need = record_len + IPFIX_SET_HEADER_LEN;
+	}
+	if (ipfix->set_id != set_id) {
+		ipfix_close_set(ipfix);
+		ipfix->set_offset = ipfix->len;
+		ipfix->set_id = set_id;
+		ipfix_put16(ipfix->buf + ipfix->len, set_id);
+		ipfix->len += IPFIX_SET_HEADER_LEN;
+	}
+
+	p = ipfix->buf + ipfix->len;
+	if (ipv6) {
+		memcpy(p, k->src_host, 16);
+		memcpy(p + 16, k->dst_host, 16);
+		p += 32;
+	} else {
+		memcpy(p, &k->src_host[12], 4);
+		memcpy(p + 4, &k->dst_host[12], 4);
+		p += 8;
+	}
+	p = ipfix_put16(p, (k->src_port < 0) ? 0 : k->src_port);
+	p = ipfix_put16(p, (k->dst_port < 0) ? 0 : k->dst_port);
+	*p++ = k->proto;
+	*p++ = ipfix_flow_direction(k->direction);
+	p = ipfix_put16(p, (k->vlan < 0) ? 0 : k->vlan);
+	p = ipfix_put32(p, (k->iface < 0) ? 0 : k->iface);
+	p = ipfix_put32(p, k->src_as);
+	p = ipfix_put32(p, k->dst_as);
+	p = ipfix_put64(p, m->packets);
+	p = ipfix_put64(p, m->bytes);
+	p = ipfix_put64(p, m->start_time / 1000);
+	p = ipfix_put64(p, m->stop_time / 1000);
+	ipfix->len += record_len;
+	ipfix->records++;
+}
+
+/* 残りを書き出して閉じる。 start の終わりで呼ぶ。 */
+void
+ipfix_close(struct dpdkflow_context *ctx)
+{
+	if (ctx->ipfix == NULL) {
+		return;
+	}
+	ipfix_flush(ctx->ipfix);
+	close(ctx->ipfix->fd);
+	free(ctx->ipfix);
+	ctx->ipfix = NULL;
+}
+
+static int
+ipfix_open_udp(struct dpdkflow_ipfix *ipfix, const char *host, const char *port)
+{
+	struct addrinfo hints;
+	struct addrinfo *res, *ai;
+	int fd = -1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		printf("ipfix_open_udp: getaddrinfo failed: %s:%s\n", host, port);
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		printf("ipfix_open_udp: connect failed: %s:%s\n", host, port);
+		return -1;
+	}
+	ipfix->fd = fd;
+	ipfix->is_file = 0;
+	return 0;
+}
+
+static int
+ipfix_open_file(struct dpdkflow_ipfix *ipfix, const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		printf("ipfix_open_file: open failed: %s\n", path);
+		return -1;
+	}
+	ipfix->fd = fd;
+	ipfix->is_file = 1;
+	return 0;
+}
+
+/*
+ * ipfix_export は "udp:<host>:<port>" か "file:<path>" の形で Go 側で組み立てられている。
+ * ipfix を使わないときは空。
+ */
+/*
+ * ipfix_add は key.af でテンプレートを選ぶが、 key.af は af を集約するときしか入らない。
+ * ホストを集約する方向では af もキーに入れ、 IPv6 のアドレスが IPv4 のテンプレートで切れないようにする。
+ * IPFIX で書き出すときは Go にメトリックを渡さないので、タグが増えることはない。
+ */
+static void
+ipfix_aggregate_af(uint32_t *flags)
+{
+	if (*flags & (aggregate_f_src_host | aggregate_f_dst_host)) {
+		*flags |= aggregate_f_af;
+	}
+}
+
+int
+ipfix_context_init(struct dpdkflow_context *ctx)
+{
+	struct dpdkflow_ipfix *ipfix;
+	char target[sizeof(ctx->ipfix_export)];
+	int ret;
+
+	printf("ipfix_context_init\n");
+
+	ctx->ipfix = NULL;
+	if (ctx->ipfix_export[0] == '\0') {
+		return 0;
+	}
+	ipfix = calloc(1, sizeof(struct dpdkflow_ipfix));
+	if (ipfix == NULL) {
+		printf("ipfix_context_init: alloc failed\n");
+		return -1;
+	}
+	strcpy(target, ctx->ipfix_export);
+	if (strncmp(target, "udp:", 4) == 0) {
+		char *host = target + 4;
+		char *port = strrchr(host, ':');
+		if (port == NULL) {
+			printf("ipfix_context_init: invalid target: %s\n", ctx->ipfix_export);
+			free(ipfix);
+			return -1;
+		}
+		*port++ = '\0';
+		ret = ipfix_open_udp(ipfix, host, port);
+	} else if (strncmp(target, "file:", 5) == 0) {
+		ret = ipfix_open_file(ipfix, target + 5);
+	} else {
+		printf("ipfix_context_init: invalid target: %s\n", ctx->ipfix_export);
+		ret = -1;
+	}
+	if (ret != 0) {
+		free(ipfix);
+		return -1;
+	}
+	ipfix->mtu = ctx->ipfix_mtu;
+	if (ipfix->mtu > IPFIX_MTU_MAX) {
+		ipfix->mtu = IPFIX_MTU_MAX;
+	}
+	ipfix->domain_id = ctx->ipfix_domain_id;
+	ipfix->record_len_ipv4 = ipfix_record_len(ipfix_fields_ipv4, IPFIX_FIELDS_NUM(ipfix_fields_ipv4));
+	ipfix->record_len_ipv6 = ipfix_record_len(ipfix_fields_ipv6, IPFIX_FIELDS_NUM(ipfix_fields_ipv6));
+	ipfix_build_templates(ipfix);
+	ipfix_begin_message(ipfix);
+	ipfix_aggregate_af(&ctx->aggregate_flags_incoming);
+	ipfix_aggregate_af(&ctx->aggregate_flags_outgoing);
+	ipfix_aggregate_af(&ctx->aggregate_flags_internal);
+	ipfix_aggregate_af(&ctx->aggregate_flags_external);
+	ctx->ipfix = ipfix;
+	return 0;
+}
@@ -1,227 +1,265 @@
 #include "dpdkflow_cgo.h"
 
-inline int
-metric_equals(struct dpdkflow_context *ctx, struct dpdkflow_metric *m1, struct dpdkflow_metric *m2)
+inline uint32_t
+metric_hash(struct dpdkflow_metric *m)
 {
-	int8_t direction;
-	if (m1->direction != m2->direction) {
-		return 0;
-	}
-	direction = m1->direction;
-	if (aggregate_flag_up(ctx, direction, aggregate_f_iface) && m1->iface != m2->iface) {
-		return 0;
-	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_af) && m1->af != m2->af) {
-		return 0;
+	return rte_hash_crc(&m->key, sizeof(struct dpdkflow_metric_key), 0);
+}
+
+inline void
+metric_merge(struct dpdkflow_metric *dst, struct dpdkflow_metric *src)
+{
+	dst->packets += src->packets;
+	dst->bytes += src->bytes;
+	dst->packets_error += src->packets_error;
+	dst->bytes_error += src->bytes_error;
+	if (src->start_time < dst->start_time) {
+		dst->start_time = src->start_time;
 	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_proto) && m1->proto != m2->proto) {
-		return 0;
+	if (src->stop_time > dst->stop_time) {
+		dst->stop_time = src->stop_time;
 	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_vlan) && m1->vlan != m2->vlan) {
-		return 0;
+}
+
+/* lcore_flow がループの先頭で呼び、 lcore_main が進めたエポックに追従する。 */
+void
+metric_epoch_sync(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard)
+{
+	uint32_t epoch = ctx->metric_epoch;
+	if (shard->metric_epoch != epoch) {
+		shard->metric_degrade = 0;
+		/* 古いテーブルへの書き込みを済ませてから切り替えを知らせる。 */
+		rte_smp_wmb();
+		shard->metric_epoch = epoch;
 	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_src_host)) {
-		for (int i = 0; i < 4; i++) {
-			if (*(uint32_t *)&m1->src_host[i * 4] != *(uint32_t *)&m2->src_host[i * 4]) {
-				return 0;
-			}
-		}
+}
+
+/* interval_align のときは区切りを interval の倍数の時刻に揃える。 */
+void
+metric_epoch_begin(struct dpdkflow_context *ctx, uint64_t current_time)
+{
+	uint64_t interval_usec = ((uint64_t)ctx->interval * 1000000);
+	if (ctx->interval_align) {
+		ctx->metric_epoch_start = current_time - current_time % interval_usec;
+	} else {
+		ctx->metric_epoch_start = current_time;
 	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_dst_host)) {
-		for (int i = 0; i < 4; i++) {
-			if (*(uint32_t *)&m1->dst_host[i * 4] != *(uint32_t *)&m2->dst_host[i * 4]) {
-				return 0;
+	ctx->metric_epoch_end = ctx->metric_epoch_start + interval_usec;
+}
+
+int
+metric_epoch_expired(struct dpdkflow_context *ctx, uint64_t current_time)
+{
+	return current_time >= ctx->metric_epoch_end;
+}
+
+/*
+ * 止めるために待ちを打ち切ったときは -1 を返す。まだ古いテーブルに書いている lcore_flow がいるので、
+ * metric_epoch_drain はすべての lcore_flow が止まるまで呼んではいけない。
+ */
+int
+metric_epoch_flip(struct dpdkflow_context *ctx, uint64_t current_time)
+{
+	/* interval_align のときは吐き出すメトリックに区切りの開始時刻を付ける。 */
+	ctx->metric_export_time = ctx->interval_align ? ctx->metric_epoch_start : 0;
+	metric_epoch_begin(ctx, current_time);
+	rte_smp_wmb();
+	ctx->metric_epoch++;
+	/* すべての lcore_flow が新しいテーブルに移るのを待つ。 */
+	for (int i = 0; i < ctx->core_num; i++) {
+		while (ctx->metric_shards[i].metric_epoch != ctx->metric_epoch) {
+			if (__atomic_load_n(&ctx->done, __ATOMIC_RELAXED)) {
+				return -1;
 			}
+			rte_pause();
 		}
 	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_src_as) && m1->src_as != m2->src_as) {
-		return 0;
-	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_dst_as) && m1->dst_as != m2->dst_as) {
-		return 0;
-	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_src_port) && m1->src_port != m2->src_port) {
-		return 0;
-	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_dst_port) && m1->dst_port != m2->dst_port) {
-		return 0;
-	}
-	if (aggregate_flag_up(ctx, direction, aggregate_f_app) && m1->app != m2->app) {
-		return 0;
-	}
-	return 1;
+	rte_smp_rmb();
+	return 0;
 }
 
-inline uint32_t
-metric_hash(struct dpdkflow_context *ctx, struct dpdkflow_metric *m)
+static void
+metric_epoch_merge(struct dpdkflow_context *ctx, struct dpdkflow_metric *m)
 {
-	uint32_t hash = 0;
-	/*
-	uint32_t hash = (uint32_t)m->direction << 12;
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_iface)) {
-		hash += m->iface;
-	}
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_af)) {
-		hash += m->af;
-	}
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_proto)) {
-		hash += m->proto;
-	}
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_vlan)) {
-		hash += m->vlan;
-	}
-	*/
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_src_host)) {
-		hash += ntohl(*(uint32_t *)&m->src_host[12]);
-	}
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_dst_host)) {
-		hash += ntohl(*(uint32_t *)&m->dst_host[12]);
-	}
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_src_as)) {
-		hash += ((uint32_t)m->src_as << 4) | ((uint32_t)m->src_as >> 28);
-	}
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_dst_as)) {
-		hash += ((uint32_t)m->dst_as << 4) | ((uint32_t)m->dst_as >> 28);
+	struct dpdkflow_metric *tmp;
+	uint32_t hash = metric_hash(m);
+	m->stop_time = ctx->metric_epoch_start;
+	/* 別の lcore_flow で集計された同じキーのメトリックをまとめる。 */
+	tmp = metric_table_lookup(&ctx->metric_merge_table, m, hash);
+	if (tmp != NULL) {
+		metric_merge(tmp, m);
+		rte_mempool_put(ctx->metric_pool, (void *)m);
+		ctx->stats[ctx->core_num].metric_freed++;
+		return;
 	}
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_src_port)) {
-		hash += ((uint32_t)m->src_port << 8) | ((uint32_t)m->src_port >> 24);
+	if (metric_table_insert(&ctx->metric_merge_table, m, hash) != 0) {
+		metric_export(ctx, m);
 	}
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_dst_port)) {
-		hash += ((uint32_t)m->dst_port << 8) | ((uint32_t)m->dst_port >> 24);
+}
+
+/*
+ * フローテーブルの埋まり具合(metric_pool のうちこの lcore_flow の取り分に対する割合)から
+ * 集約キーの粗さを決める。エポックの途中で細かくは戻さない。
+ */
+void
+metric_degrade_update(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard)
+{
+	uint64_t share = ctx->metrics_num / ctx->core_num;
+	uint64_t usage = (uint64_t)metric_shard_table(shard)->entries * 100 / share;
+	uint8_t degrade = 0;
+	if (usage >= 90) {
+		degrade = DEGRADE_NO_HOST;
+	} else if (usage >= 75) {
+		degrade = DEGRADE_PREFIX;
+	} else if (usage >= 50) {
+		degrade = DEGRADE_PORTS;
 	}
-	if (aggregate_flag_up(ctx, m->direction, aggregate_f_app)) {
-		hash += ((uint32_t)m->app << 12) | ((uint32_t)m->app >> 20);
+	if (degrade > shard->metric_degrade) {
+		shard->metric_degrade = degrade;
 	}
-	hash ^= (hash >> 20);
-	hash ^= (hash >> 10);
-	hash ^= (hash >> 5);
-	hash &= ctx->metrics_num - 1;
-	return hash;
 }
 
-int
-metric_deq(struct dpdkflow_context *ctx, struct dpdkflow_metric **mbuf, int mbuf_size)
+static inline struct dpdkflow_metric *
+metric_overflow_slot(struct dpdkflow_metric *overflow, int8_t direction, uint8_t af, int8_t iface)
 {
-	uint64_t current_time = now();
-	uint64_t start_time;
-	uint64_t interval_usec = ((uint64_t)ctx->interval * 1000000);
-	int can_deq = 0;
-	struct dpdkflow_metric *head = NULL;
-	rte_rwlock_read_lock(&ctx->metric_lock);
-	{
-		start_time = ctx->metric_list_head->start_time;
-		if ((ctx->metric_list_head != NULL) && (current_time - start_time) >= interval_usec) {
-			can_deq = 1;
-		}
+	int af_index = (af == AF_IPV6) ? 1 : 0;
+	int iface_index = (iface < 0) ? 0 : iface;
+	return &overflow[(direction * 2 + af_index) * PORT_MAX + iface_index];
+}
+
+/*
+ * エントリを確保できなかったパケットは、キーを方向と(集約していれば) AF とポートだけにした
+ * あふれ用のメトリックに足し込み、合計が減らないようにする。
+ */
+void
+metric_overflow(struct dpdkflow_metric_shard *shard, struct dpdkflow_metric *m)
+{
+	struct dpdkflow_metric *o = metric_overflow_slot(&shard->metric_overflow[shard->metric_epoch & 1][0][0][0],
+			m->key.direction, m->key.af, m->key.iface);
+	if (o->packets == 0) {
+		metric_init(o);
+		o->key.direction = m->key.direction;
+		o->key.af = m->key.af;
+		o->key.iface = m->key.iface;
+		o->key.overflow = 1;
+		o->start_time = m->start_time;
 	}
-	rte_rwlock_read_unlock(&ctx->metric_lock);
-	if (!can_deq) {
-		return 0;
-	}
-	int filled = 0;
-	rte_rwlock_write_lock(&ctx->metric_lock);
-	{
-		int i;
-		for (i = 0; i < mbuf_size && ctx->metric_list_head != NULL; i++) {
-			start_time = ctx->metric_list_head->start_time;
-			if ((current_time - start_time) < interval_usec) {
-				break;
-			}
-			head = ctx->metric_list_head;
-			ctx->metric_list_head = head->list_next;
-			if (ctx->metric_list_head == NULL) {
-				ctx->metric_list_tail = NULL;
+	o->packets += m->packets;
+	o->bytes += m->bytes;
+}
+
+static void
+metric_overflow_drain(struct dpdkflow_context *ctx)
+{
+	uint32_t old = (ctx->metric_epoch - 1) & 1;
+	int num = DIRECTION_NUM * 2 * PORT_MAX;
+	for (int j = 0; j < num; j++) {
+		struct dpdkflow_metric sum;
+		sum.packets = 0;
+		for (int i = 0; i < ctx->core_num; i++) {
+			struct dpdkflow_metric *o = &ctx->metric_shards[i].metric_overflow[old][0][0][0] + j;
+			if (o->packets == 0) {
+				continue;
 			}
-			uint32_t hash = metric_hash(ctx, head);
-			if (ctx->metric_hash_table[hash] == head) {
-				ctx->metric_hash_table[hash] = head->hash_next;
+			if (sum.packets == 0) {
+				sum = *o;
 			} else {
-				struct dpdkflow_metric *tmp;
-				for (tmp = ctx->metric_hash_table[hash]; tmp != NULL; tmp = tmp->hash_next) {
-					if (tmp->hash_next == head) {
-						tmp->hash_next = head->hash_next;
-						break;
-					}
-				}
+				metric_merge(&sum, o);
 			}
-			mbuf[i] = head;
+			o->packets = 0;
+		}
+		if (sum.packets > 0) {
+			sum.stop_time = ctx->metric_epoch_start;
+			metric_export_append(ctx, &sum);
 		}
-		filled = i;
 	}
-	rte_rwlock_write_unlock(&ctx->metric_lock);
-	for (int i = 0; i < filled; i++) {
-		mbuf[i]->hash_next = NULL;
-		mbuf[i]->list_next = NULL;
-		mbuf[i]->stop_time = current_time;
+}
+
+/* 直前のエポックのテーブルをまとめて吐き出し、空にする。 */
+void
+metric_epoch_drain(struct dpdkflow_context *ctx)
+{
+	uint32_t old = (ctx->metric_epoch - 1) & 1;
+	for (int i = 0; i < ctx->core_num; i++) {
+		metric_table_drain(&ctx->metric_shards[i].metric_tables[old], metric_epoch_merge, ctx);
 	}
-	return filled;
+	metric_table_drain(&ctx->metric_merge_table, metric_export, ctx);
+	topk_drain(ctx);
+	metric_overflow_drain(ctx);
+	metric_export_flush(ctx);
+}
+
+int
+metric_insert(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard,
+		struct dpdkflow_metric *m, uint32_t hash)
+{
+	return metric_table_insert(metric_shard_table(shard), m, hash);
 }
 
 void
-metric_update(struct dpdkflow_context *ctx, struct dpdkflow_metric *m, int *stored)
+metric_cache_fill(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard, uint32_t n)
 {
-	struct dpdkflow_metric *tmp;
-	uint32_t hash = metric_hash(ctx, m);
-	rte_rwlock_read_lock(&ctx->metric_lock);
-	{
-		for (tmp = ctx->metric_hash_table[hash]; tmp != NULL; tmp = tmp->hash_next) {
-			if (metric_equals(ctx, tmp, m)) {
-				break;
-			}
-		}
-		if (tmp != NULL) {
-			/* XXX: */
-			tmp->packets += m->packets;
-			tmp->bytes += m->bytes;
-		}
+	uint32_t want;
+	if (shard->metric_cache_num >= n) {
+		return;
 	}
-	rte_rwlock_read_unlock(&ctx->metric_lock);
-	if (tmp != NULL) {
-		*stored = 0;
+	want = METRIC_CACHE_SIZE - shard->metric_cache_num;
+	if (rte_mempool_get_bulk(ctx->metric_pool,
+			(void **)&shard->metric_cache[shard->metric_cache_num], want) == 0) {
+		shard->metric_cache_num += want;
 		return;
 	}
-	rte_rwlock_write_lock(&ctx->metric_lock);
-	{
-		m->hash_next = ctx->metric_hash_table[hash];
-		ctx->metric_hash_table[hash] = m;
-		if (ctx->metric_list_tail != NULL) {
-			ctx->metric_list_tail->list_next = m;
-			ctx->metric_list_tail = m;
-		} else {
-			ctx->metric_list_head = m;
-			ctx->metric_list_tail = m;
+	/* まとめて取れないほど残り少ないときは取れるだけ取る。 */
+	while (shard->metric_cache_num < n) {
+		if (rte_mempool_get(ctx->metric_pool,
+				(void **)&shard->metric_cache[shard->metric_cache_num]) < 0) {
+			break;
 		}
+		shard->metric_cache_num++;
 	}
-	rte_rwlock_write_unlock(&ctx->metric_lock);
-	*stored = 1;
-	return;
+}
+
+struct dpdkflow_metric_table *
+metric_shard_table(struct dpdkflow_metric_shard *shard)
+{
+	return &shard->metric_tables[shard->metric_epoch & 1];
+}
+
+struct dpdkflow_metric *
+metric_cache_get(struct dpdkflow_metric_shard *shard)
+{
+	if (shard->metric_cache_num == 0) {
+		return NULL;
+	}
+	return shard->metric_cache[--shard->metric_cache_num];
 }
 
 inline void
 metric_print(struct dpdkflow_metric *m)
 {
+	struct dpdkflow_metric_key *k = &m->key;
 	printf("%2d %2d %2d %2d %4d "
 	       "%02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x "
 	       "%02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x %02x%02x%02x%02x "
-	       "%10ld %10ld %6d %6d %08x %s\n",
-			m->iface,
-			m->direction,
-			m->af,
-			m->proto,
-			m->vlan,
-			m->src_host[0], m->src_host[1], m->src_host[2], m->src_host[3],
-			m->src_host[4], m->src_host[5], m->src_host[6], m->src_host[7],
-			m->src_host[8], m->src_host[9], m->src_host[10], m->src_host[11],
-			m->src_host[12], m->src_host[13], m->src_host[14], m->src_host[15],
-			m->dst_host[0], m->dst_host[1], m->dst_host[2], m->dst_host[3],
-			m->dst_host[4], m->dst_host[5], m->dst_host[6], m->dst_host[7],
-			m->dst_host[8], m->dst_host[9], m->dst_host[10], m->dst_host[11],
-			m->dst_host[12], m->dst_host[13], m->dst_host[14], m->dst_host[15],
-			m->src_as,
-			m->dst_as,
-			m->src_port,
-			m->dst_port,
-			m->app,
+	       "%10u %10u %6d %6d %08x %s\n",
+			k->iface,
+			k->direction,
+			k->af,
+			k->proto,
+			k->vlan,
+			k->src_host[0], k->src_host[1], k->src_host[2], k->src_host[3],
+			k->src_host[4], k->src_host[5], k->src_host[6], k->src_host[7],
+			k->src_host[8], k->src_host[9], k->src_host[10], k->src_host[11],
+			k->src_host[12], k->src_host[13], k->src_host[14], k->src_host[15],
+			k->dst_host[0], k->dst_host[1], k->dst_host[2], k->dst_host[3],
+			k->dst_host[4], k->dst_host[5], k->dst_host[6], k->dst_host[7],
+			k->dst_host[8], k->dst_host[9], k->dst_host[10], k->dst_host[11],
+			k->dst_host[12], k->dst_host[13], k->dst_host[14], k->dst_host[15],
+			k->src_as,
+			k->dst_as,
+			k->src_port,
+			k->dst_port,
+			k->app,
 			m->app_desc);
 }
 
@@ -229,26 +267,50 @@ void
 metric_init(struct dpdkflow_metric *m)
 {
 	memset(m, 0, sizeof(struct dpdkflow_metric));
-	m->iface = -1;
-	m->direction = -1;
-	m->vlan = -1;
-	m->src_as = -1;
-	m->dst_as = -1;
-	m->src_port = -1;
-	m->dst_port = -1;
+	m->key.iface = -1;
+	m->key.direction = -1;
+	m->key.vlan = -1;
+	m->key.src_port = -1;
+	m->key.dst_port = -1;
 }
 
-void
+int
 metric_context_init(struct dpdkflow_context *ctx)
 {
 	printf("metric_context_init\n");
 
-	ctx->metric_hash_table = malloc(sizeof(struct dpdkflow_metric *) * ctx->metrics_num);
-	for (int i = 0; i < ctx->metrics_num; i++) {
-		ctx->metric_hash_table[i] = NULL;
+	ctx->metric_shards = rte_zmalloc("metric_shards",
+			sizeof(struct dpdkflow_metric_shard) * ctx->core_num, RTE_CACHE_LINE_SIZE);
+	if (ctx->metric_shards == NULL) {
+		printf("metric_context_init: metric_shards alloc failed\n");
+		return -1;
+	}
+	for (int i = 0; i < ctx->core_num; i++) {
+		struct dpdkflow_metric_shard *shard = &ctx->metric_shards[i];
+		for (int j = 0; j < 2; j++) {
+			char name[32];
+			snprintf(name, sizeof(name), "metric_table_%d_%d", i, j);
+			if (metric_table_init(&shard->metric_tables[j], name, ctx->metrics_num) != 0) {
+				return -1;
+			}
+		}
+		shard->metric_epoch = 0;
+		shard->metric_degrade = 0;
+		shard->metric_cache_num = 0;
+	}
+
+	/* topk モードではすべての lcore_flow のカウンタをまとめられる大きさにする。 */
+	uint32_t merge_capacity = ctx->metrics_num;
+	if (ctx->topk * TOPK_CAPACITY_FACTOR * ctx->core_num > merge_capacity) {
+		merge_capacity = ctx->topk * TOPK_CAPACITY_FACTOR * ctx->core_num;
+	}
+	/* 追い出しに失敗すると同じキーが二重に吐き出されるので、倍の大きさにして余裕を持たせる。 */
+	if (metric_table_init(&ctx->metric_merge_table, "metric_merge_table", merge_capacity * 2) != 0) {
+		return -1;
 	}
-	ctx->metric_list_head = NULL;
-	ctx->metric_list_tail = NULL;
+	ctx->metric_epoch = 0;
+	ctx->metric_export_time = 0;
+	metric_epoch_begin(ctx, clock_now(ctx));
 
-	rte_rwlock_init(&ctx->metric_lock);
+	return 0;
 }
@@ -0,0 +1,272 @@
+#include "dpdkflow_cgo.h"
+
+/*
+ * バケット単位のカッコーハッシュ。
+ * キーごとにバケットの候補が 2 つあり、バケットには署名(ハッシュの上位 16 ビット)と
+ * メトリックへのポインタを METRIC_TABLE_BUCKET_ENTRIES 個ずつ並べる。
+ * 署名が一致したものだけキーを比較する。
+ */
+
+#define METRIC_TABLE_MAX_KICKS 32
+
+struct metric_table_path {
+	uint32_t index;
+	int slot;
+};
+
+static inline uint16_t
+metric_table_sig(uint32_t hash)
+{
+	return hash >> 16;
+}
+
+static inline uint32_t
+metric_table_prim_index(struct dpdkflow_metric_table *t, uint32_t hash)
+{
+	return hash & t->bucket_mask;
+}
+
+static inline uint32_t
+metric_table_alt_index(struct dpdkflow_metric_table *t, uint32_t index, uint16_t sig)
+{
+	return (index ^ ((uint32_t)sig * 0x5bd1e995)) & t->bucket_mask;
+}
+
+static inline uint32_t
+metric_table_sig_match(struct dpdkflow_metric_bucket *b, uint16_t sig)
+{
+	uint32_t match = 0;
+	for (int i = 0; i < METRIC_TABLE_BUCKET_ENTRIES; i++) {
+		if (b->sigs[i] == sig && b->metrics[i] != NULL) {
+			match |= (1 << i);
+		}
+	}
+	return match;
+}
+
+static inline struct dpdkflow_metric *
+metric_table_match(struct dpdkflow_metric_bucket *b, uint32_t match, struct dpdkflow_metric_key *key)
+{
+	while (match) {
+		int i = __builtin_ctz(match);
+		if (metric_key_equals(&b->metrics[i]->key, key)) {
+			return b->metrics[i];
+		}
+		match &= ~(1 << i);
+	}
+	return NULL;
+}
+
+static inline int
+metric_table_empty_slot(struct dpdkflow_metric_bucket *b)
+{
+	for (int i = 0; i < METRIC_TABLE_BUCKET_ENTRIES; i++) {
+		if (b->metrics[i] == NULL) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+struct dpdkflow_metric *
+metric_table_lookup(struct dpdkflow_metric_table *t, struct dpdkflow_metric *m, uint32_t hash)
+{
+	uint16_t sig = metric_table_sig(hash);
+	uint32_t prim = metric_table_prim_index(t, hash);
+	uint32_t alt = metric_table_alt_index(t, prim, sig);
+	struct dpdkflow_metric *found;
+	t->lookups++;
+	found = metric_table_match(&t->buckets[prim], metric_table_sig_match(&t->buckets[prim], sig), &m->key);
+	if (found != NULL) {
+		return found;
+	}
+	t->lookups_alt++;
+	return metric_table_match(&t->buckets[alt], metric_table_sig_match(&t->buckets[alt], sig), &m->key);
+}
+
+void
+metric_table_lookup_bulk(struct dpdkflow_metric_table *t, struct dpdkflow_metric *metrics,
+		uint32_t *hashes, int *valid, int n, struct dpdkflow_metric **found)
+{
+	uint32_t prim[BURST_MAX];
+	uint32_t alt[BURST_MAX];
+	uint32_t prim_match[BURST_MAX];
+	uint32_t alt_match[BURST_MAX];
+
+	/* 候補のバケットを先読みする。 */
+	for (int k = 0; k < n; k++) {
+		if (!valid[k]) {
+			continue;
+		}
+		prim[k] = metric_table_prim_index(t, hashes[k]);
+		alt[k] = metric_table_alt_index(t, prim[k], metric_table_sig(hashes[k]));
+		rte_prefetch0(&t->buckets[prim[k]]);
+		rte_prefetch0(&t->buckets[alt[k]]);
+	}
+	/* 署名を比べて候補のメトリックを先読みする。 */
+	for (int k = 0; k < n; k++) {
+		uint16_t sig;
+		if (!valid[k]) {
+			continue;
+		}
+		sig = metric_table_sig(hashes[k]);
+		prim_match[k] = metric_table_sig_match(&t->buckets[prim[k]], sig);
+		alt_match[k] = metric_table_sig_match(&t->buckets[alt[k]], sig);
+		if (prim_match[k]) {
+			rte_prefetch0(t->buckets[prim[k]].metrics[__builtin_ctz(prim_match[k])]);
+		} else if (alt_match[k]) {
+			rte_prefetch0(t->buckets[alt[k]].metrics[__builtin_ctz(alt_match[k])]);
+		}
+	}
+	/* キーを比べる。 */
+	for (int k = 0; k < n; k++) {
+		if (!valid[k]) {
+			found[k] = NULL;
+			continue;
+		}
+		t->lookups++;
+		found[k] = metric_table_match(&t->buckets[prim[k]], prim_match[k], &metrics[k].key);
+		if (found[k] == NULL) {
+			t->lookups_alt++;
+			found[k] = metric_table_match(&t->buckets[alt[k]], alt_match[k], &metrics[k].key);
+		}
+	}
+}
+
+static inline int
+metric_table_path_contains(struct metric_table_path *path, int depth, uint32_t index, int slot)
+{
+	for (int i = 0; i < depth; i++) {
+		if (path[i].index == index && path[i].slot == slot) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+metric_table_insert(struct dpdkflow_metric_table *t, struct dpdkflow_metric *m, uint32_t hash)
+{
+	struct metric_table_path path[METRIC_TABLE_MAX_KICKS];
+	uint16_t sig = metric_table_sig(hash);
+	uint32_t prim = metric_table_prim_index(t, hash);
+	uint32_t alt = metric_table_alt_index(t, prim, sig);
+	uint32_t index;
+	int slot;
+
+	slot = metric_table_empty_slot(&t->buckets[prim]);
+	if (slot >= 0) {
+		index = prim;
+		goto store;
+	}
+	slot = metric_table_empty_slot(&t->buckets[alt]);
+	if (slot >= 0) {
+		index = alt;
+		goto store;
+	}
+
+	/* 追い出す経路を先に探し、見つかったら後ろから順に動かす。 */
+	index = prim;
+	for (int depth = 0; depth < METRIC_TABLE_MAX_KICKS; depth++) {
+		struct dpdkflow_metric_bucket *b = &t->buckets[index];
+		int victim = -1;
+		for (int i = 0; i < METRIC_TABLE_BUCKET_ENTRIES; i++) {
+			int s = (hash + depth + i) % METRIC_TABLE_BUCKET_ENTRIES;
+			if (!metric_table_path_contains(path, depth, index, s)) {
+				victim = s;
+				break;
+			}
+		}
+		if (victim < 0) {
+			break;
+		}
+		path[depth].index = index;
+		path[depth].slot = victim;
+		uint32_t next = metric_table_alt_index(t, index, b->sigs[victim]);
+		int free_slot = metric_table_empty_slot(&t->buckets[next]);
+		if (free_slot < 0) {
+			index = next;
+			continue;
+		}
+		uint32_t dst_index = next;
+		int dst_slot = free_slot;
+		for (int i = depth; i >= 0; i--) {
+			struct dpdkflow_metric_bucket *src = &t->buckets[path[i].index];
+			t->buckets[dst_index].sigs[dst_slot] = src->sigs[path[i].slot];
+			t->buckets[dst_index].metrics[dst_slot] = src->metrics[path[i].slot];
+			dst_index = path[i].index;
+			dst_slot = path[i].slot;
+		}
+		t->kicks += depth + 1;
+		index = path[0].index;
+		slot = path[0].slot;
+		goto store;
+	}
+	t->insert_failed++;
+	return -1;
+
+store:
+	t->buckets[index].sigs[slot] = sig;
+	t->buckets[index].metrics[slot] = m;
+	t->entries++;
+	return 0;
+}
+
+void
+metric_table_remove(struct dpdkflow_metric_table *t, struct dpdkflow_metric *m, uint32_t hash)
+{
+	uint16_t sig = metric_table_sig(hash);
+	uint32_t index[2];
+	index[0] = metric_table_prim_index(t, hash);
+	index[1] = metric_table_alt_index(t, index[0], sig);
+	for (int j = 0; j < 2; j++) {
+		struct dpdkflow_metric_bucket *b = &t->buckets[index[j]];
+		for (int i = 0; i < METRIC_TABLE_BUCKET_ENTRIES; i++) {
+			if (b->metrics[i] == m) {
+				b->metrics[i] = NULL;
+				b->sigs[i] = 0;
+				t->entries--;
+				return;
+			}
+		}
+	}
+}
+
+void
+metric_table_reset(struct dpdkflow_metric_table *t)
+{
+	memset(t->buckets, 0, sizeof(struct dpdkflow_metric_bucket) * (t->bucket_mask + 1));
+	t->entries = 0;
+}
+
+/* すべてのエントリを fn に渡してからテーブルを丸ごと空にする。 */
+void
+metric_table_drain(struct dpdkflow_metric_table *t,
+		void (*fn)(struct dpdkflow_context *ctx, struct dpdkflow_metric *m), struct dpdkflow_context *ctx)
+{
+	for (uint32_t i = 0; i <= t->bucket_mask; i++) {
+		struct dpdkflow_metric_bucket *b = &t->buckets[i];
+		for (int j = 0; j < METRIC_TABLE_BUCKET_ENTRIES; j++) {
+			if (b->metrics[j] != NULL) {
+				fn(ctx, b->metrics[j]);
+			}
+		}
+	}
+	metric_table_reset(t);
+}
+
+int
+metric_table_init(struct dpdkflow_metric_table *t, const char *name, uint32_t capacity)
+{
+	uint32_t bucket_num = rte_align32pow2((capacity + METRIC_TABLE_BUCKET_ENTRIES - 1)
+			/ METRIC_TABLE_BUCKET_ENTRIES);
+	memset(t, 0, sizeof(struct dpdkflow_metric_table));
+	t->buckets = rte_zmalloc(name, sizeof(struct dpdkflow_metric_bucket) * bucket_num, RTE_CACHE_LINE_SIZE);
+	if (t->buckets == NULL) {
+		printf("metric_table_init: %s alloc failed\n", name);
+		return -1;
+	}
+	t->bucket_mask = bucket_num - 1;
+	t->slots = bucket_num * METRIC_TABLE_BUCKET_ENTRIES;
+	return 0;
+}
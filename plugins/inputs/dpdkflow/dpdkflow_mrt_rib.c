@@ -1,5 +1,13 @@
 #include "dpdkflow_cgo.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include <bzlib.h>
+
+/* 圧縮されたダンプを展開しながら読むときのバッファの大きさ。これより大きいレコードが来たら広げる。 */
+#define MRT_STREAM_BUF_SIZE (1 << 20)
+
 struct mrt_hdr {
 	uint32_t timestamp;
 	uint16_t type;
@@ -8,13 +16,13 @@ struct mrt_hdr {
 };
 
 static inline int
-exceeded(uint8_t *curr, uint8_t *head, int size)
+exceeded(uint8_t *curr, uint8_t *head, size_t size)
 {
 	return ((size_t)curr >= (size_t)head + size);
 }
 
 static inline int
-included(uint8_t *curr, uint8_t *head, int size)
+included(uint8_t *curr, uint8_t *head, size_t size)
 {
 	return ((size_t)curr <= (size_t)head + size);
 }
@@ -32,8 +40,9 @@ mrt_rib_table_add_ipv6(struct rte_lpm6 *lpm6, uint8_t *prefix, uint8_t prefix_le
 	int ret = rte_lpm6_add(lpm6, prefix, prefix_len, as_num);
 }
 
+/* as_size は AS 番号の大きさ。 TABLE_DUMP_V2 と AS4_PATH は 4 、 2 バイト AS の BGP4MP では 2 。 */
 uint32_t
-parse_as_path_attrs(char *buf, int len)
+parse_as_path_attrs(uint8_t *buf, int len, int as_size)
 {
 	//printf("parse_as_path_attrs: \n");
 	uint32_t last_as_num = 0;
@@ -46,15 +55,19 @@ parse_as_path_attrs(char *buf, int len)
 		uint8_t segment_type = p[0];
 		uint8_t segment_length = p[1];
 		p += 2;
-		uint32_t *as_num = (uint32_t *)p;
-		p += 4 * segment_length;
+		uint8_t *as_num = p;
+		p += as_size * segment_length;
 		if (!included(p, buf, len)) {
 			printf("parse_as_path_attrs: invalid data (2)\n");
 			return last_as_num;
 		}
 		for (int i = 0; i < segment_length; i++) {
-			last_as_num = ntohl(*as_num);
-			as_num++;
+			if (as_size == 2) {
+				last_as_num = ntohs(*(uint16_t *)as_num);
+			} else {
+				last_as_num = ntohl(*(uint32_t *)as_num);
+			}
+			as_num += as_size;
 		}
 	}
 	return last_as_num;
@@ -86,15 +99,16 @@ parse_attrs(uint8_t *buf, int len)
 			return 0;
 		}
 		if (attr_type_code == 2) {
-			return parse_as_path_attrs(p, attr_len);
+			return parse_as_path_attrs(p, attr_len, 4);
 		}
 		p += attr_len;
 	}
 	return 0;
 }
 
-void
-parse_rib(uint8_t *buf, int len, uint16_t subtype, struct rte_lpm *lpm_ipv4, struct rte_lpm6 *lpm_ipv6)
+/* 追加したプレフィクスの数(0 か 1)を返す。 */
+int
+parse_rib(uint8_t *buf, size_t len, uint16_t subtype, struct mrt_rib_loader *l)
 {
 	uint8_t *p = buf;
 	uint32_t seq_num;
@@ -107,26 +121,30 @@ parse_rib(uint8_t *buf, int len, uint16_t subtype, struct rte_lpm *lpm_ipv4, str
 
 	if (!included(p + sizeof(uint32_t) + sizeof(uint8_t), buf, len)) {
 		printf("parse_rib: invalid data (1)\n");
-		return;
+		return 0;
 	}
 	seq_num = ntohl(*(uint32_t *)p);
 	p += sizeof(uint32_t);
 	prefix_len = *p;
 	p += sizeof(uint8_t);
 	array_len = ((prefix_len + 7) >> 3);
+	if (prefix_len > ((subtype == 2) ? 32 : 128) || !included(p + array_len, buf, len)) {
+		printf("parse_rib: invalid data (5)\n");
+		return 0;
+	}
 	memcpy(prefix, p, array_len);
 	memset(prefix + array_len, 0, 16 - array_len);
 	p += array_len;
 	if (!included(p + sizeof(uint16_t), buf, len)) {
 		printf("parse_rib: invalid data (2)\n");
-		return;
+		return 0;
 	}
 	entry_count = ntohs(*(uint16_t *)p);
 	p += sizeof(uint16_t);
 	for (int i = 0; i < entry_count; i++) {
 		if (!included(p + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t), buf, len)) {
 			printf("parse_rib: invalid data (3)\n");
-			return;
+			return 0;
 		}
 		uint32_t as_num;
 		uint16_t peer_index = ntohs(*(uint16_t *)p);
@@ -137,7 +155,11 @@ parse_rib(uint8_t *buf, int len, uint16_t subtype, struct rte_lpm *lpm_ipv4, str
 		p += sizeof(uint16_t);
 		if (!included(p + attr_len, buf, len)) {
 			printf("parse_rib: invalid data (4)\n");
-			return;
+			return 0;
+		}
+		if (l->peer_filter != 0 && !(l->peer_index_match[peer_index >> 3] & (1 << (peer_index & 7)))) {
+			p += attr_len;
+			continue;
 		}
 		as_num = parse_attrs(p, attr_len);
 		p += attr_len;
@@ -151,49 +173,388 @@ parse_rib(uint8_t *buf, int len, uint16_t subtype, struct rte_lpm *lpm_ipv4, str
 		*/
 		if (as_num > 0) {
 			if (subtype == 2) {
-				mrt_rib_table_add_ipv4(lpm_ipv4, prefix, prefix_len, as_num);
+				mrt_rib_table_add_ipv4(l->lpm_ipv4, prefix, prefix_len, as_num);
 			}
 			if (subtype == 4) {
-				mrt_rib_table_add_ipv6(lpm_ipv6, prefix, prefix_len, as_num);
+				mrt_rib_table_add_ipv6(l->lpm_ipv6, prefix, prefix_len, as_num);
 			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* ctx の mrt_peers の設定を l に写す。 */
+void
+mrt_rib_loader_peers(struct mrt_rib_loader *l, struct dpdkflow_context *ctx)
+{
+	l->peer_filter = ctx->mrt_peer_filter;
+	memcpy(l->peer_ipv4, ctx->mrt_peer_ipv4, sizeof(l->peer_ipv4));
+	memcpy(l->peer_ipv6, ctx->mrt_peer_ipv6, sizeof(l->peer_ipv6));
+}
+
+/* addr のピアの経路を使うなら 1 を返す。 ipv6 なら addr は 16 バイト、そうでなければ 4 バイト。 */
+int
+mrt_rib_peer_match(struct mrt_rib_loader *l, int ipv6, uint8_t *addr)
+{
+	if (l->peer_filter == 0) {
+		return 1;
+	}
+	if (ipv6) {
+		return (l->peer_filter & MRT_PEER_IPV6) && memcmp(addr, l->peer_ipv6, 16) == 0;
+	}
+	return (l->peer_filter & MRT_PEER_IPV4) && memcmp(addr, l->peer_ipv4, 4) == 0;
+}
+
+/* TABLE_DUMP_V2 の PEER_INDEX_TABLE を読み、 mrt_peers で選んだピアの番号に印を付ける。 */
+static void
+parse_peer_index_table(uint8_t *buf, size_t len, struct mrt_rib_loader *l)
+{
+	uint8_t *p = buf;
+	uint16_t view_name_len;
+	uint16_t peer_count;
+	int matched = 0;
+
+	memset(l->peer_index_match, 0, sizeof(l->peer_index_match));
+	/* コレクタの BGP ID */
+	p += sizeof(uint32_t);
+	if (!included(p + sizeof(uint16_t), buf, len)) {
+		printf("parse_peer_index_table: invalid data (1)\n");
+		return;
+	}
+	view_name_len = ntohs(*(uint16_t *)p);
+	p += sizeof(uint16_t) + view_name_len;
+	if (!included(p + sizeof(uint16_t), buf, len)) {
+		printf("parse_peer_index_table: invalid data (2)\n");
+		return;
+	}
+	peer_count = ntohs(*(uint16_t *)p);
+	p += sizeof(uint16_t);
+	for (int i = 0; i < peer_count; i++) {
+		if (!included(p + sizeof(uint8_t) + sizeof(uint32_t), buf, len)) {
+			printf("parse_peer_index_table: invalid data (3)\n");
+			return;
+		}
+		/* ピアの種類のビット 0 は IPv6 アドレス、ビット 1 は 4 バイトの AS 番号 */
+		uint8_t peer_type = *p;
+		int ipv6 = peer_type & 0x01;
+		int addr_len = ipv6 ? 16 : 4;
+		int as_len = (peer_type & 0x02) ? 4 : 2;
+		/* 種類と BGP ID */
+		p += sizeof(uint8_t) + sizeof(uint32_t);
+		if (!included(p + addr_len + as_len, buf, len)) {
+			printf("parse_peer_index_table: invalid data (4)\n");
 			return;
 		}
+		if (mrt_rib_peer_match(l, ipv6, p)) {
+			l->peer_index_match[i >> 3] |= 1 << (i & 7);
+			matched++;
+		}
+		p += addr_len + as_len;
+	}
+	if (l->peer_filter != 0 && matched == 0) {
+		printf("parse_peer_index_table: no peer matches mrt_peers\n");
 	}
 }
 
-uint32_t
-mrt_rib_lookup(struct dpdkflow_context *ctx, uint8_t af, uint8_t *addr)
+/*
+ * buf に並んだ MRT レコードをその場で読み、 LPM に反映する。
+ * TABLE_DUMP_V2 の RIB と BGP4MP の UPDATE を読む。
+ * 末尾の途中で切れたレコードは読まずに残し、読み終えたバイト数を返す。
+ */
+static size_t
+mrt_rib_parse_records(uint8_t *buf, size_t len, struct mrt_rib_loader *l)
+{
+	size_t off = 0;
+	while (len - off >= sizeof(struct mrt_hdr)) {
+		struct mrt_hdr *hdr = (struct mrt_hdr *)(buf + off);
+		uint16_t type = ntohs(hdr->type);
+		uint16_t subtype = ntohs(hdr->subtype);
+		uint32_t length = ntohl(hdr->length);
+		if (len - off - sizeof(struct mrt_hdr) < length) {
+			break;
+		}
+		off += sizeof(struct mrt_hdr);
+		if (type == 13 && subtype == 1) {
+			parse_peer_index_table(buf + off, length, l);
+		}
+		if (type == 13 && (subtype == 2 || subtype == 4)) {
+			l->prefixes += parse_rib(buf + off, length, subtype, l);
+		}
+		if (type == 16 || type == 17) {
+			mrt_update_parse(buf + off, length, type, subtype, l);
+		}
+		off += length;
+		l->records++;
+	}
+	l->bytes += off;
+	return off;
+}
+
+/*
+ * 圧縮されたダンプを読むためのもの。 read は読めたバイト数を返し、終わりなら 0 、失敗なら -1 を返す。
+ */
+struct mrt_reader {
+	ssize_t (*read)(struct mrt_reader *r, uint8_t *buf, size_t len);
+	void (*close)(struct mrt_reader *r);
+	gzFile gz;
+	FILE *fp;
+	BZFILE *bz;
+};
+
+static ssize_t
+mrt_reader_gz_read(struct mrt_reader *r, uint8_t *buf, size_t len)
+{
+	int n = gzread(r->gz, buf, len);
+	if (n < 0) {
+		int errnum;
+		printf("mrt_reader_gz_read: %s\n", gzerror(r->gz, &errnum));
+		return -1;
+	}
+	return n;
+}
+
+static void
+mrt_reader_gz_close(struct mrt_reader *r)
+{
+	gzclose(r->gz);
+}
+
+static int
+mrt_reader_gz_open(struct mrt_reader *r, const char *path)
+{
+	r->gz = gzopen(path, "rb");
+	if (r->gz == NULL) {
+		printf("mrt_reader_gz_open: gzopen failed\n");
+		return -1;
+	}
+	gzbuffer(r->gz, MRT_STREAM_BUF_SIZE);
+	r->read = mrt_reader_gz_read;
+	r->close = mrt_reader_gz_close;
+	return 0;
+}
+
+/* pbzip2 などが作る複数のストリームをつなげたファイルも読めるよう、ストリームの終わりで開き直す。 */
+static ssize_t
+mrt_reader_bz_read(struct mrt_reader *r, uint8_t *buf, size_t len)
+{
+	int bzerror;
+	int n;
+	while (1) {
+		if (r->bz == NULL) {
+			return 0;
+		}
+		n = BZ2_bzRead(&bzerror, r->bz, buf, len);
+		if (bzerror == BZ_OK) {
+			return n;
+		}
+		if (bzerror != BZ_STREAM_END) {
+			printf("mrt_reader_bz_read: BZ2_bzRead failed: %d\n", bzerror);
+			return -1;
+		}
+		void *unused;
+		int unused_num;
+		char rest[BZ_MAX_UNUSED];
+		BZ2_bzReadGetUnused(&bzerror, r->bz, &unused, &unused_num);
+		memcpy(rest, unused, unused_num);
+		BZ2_bzReadClose(&bzerror, r->bz);
+		r->bz = NULL;
+		if (unused_num == 0) {
+			int c = fgetc(r->fp);
+			if (c == EOF) {
+				return n;
+			}
+			ungetc(c, r->fp);
+		}
+		r->bz = BZ2_bzReadOpen(&bzerror, r->fp, 0, 0, rest, unused_num);
+		if (bzerror != BZ_OK) {
+			printf("mrt_reader_bz_read: BZ2_bzReadOpen failed: %d\n", bzerror);
+			r->bz = NULL;
+			return -1;
+		}
+		if (n > 0) {
+			return n;
+		}
+	}
+}
+
+static void
+mrt_reader_bz_close(struct mrt_reader *r)
+{
+	int bzerror;
+	if (r->bz != NULL) {
+		BZ2_bzReadClose(&bzerror, r->bz);
+	}
+	fclose(r->fp);
+}
+
+static int
+mrt_reader_bz_open(struct mrt_reader *r, const char *path)
+{
+	int bzerror;
+	r->fp = fopen(path, "rb");
+	if (r->fp == NULL) {
+		printf("mrt_reader_bz_open: fopen failed\n");
+		return -1;
+	}
+	r->bz = BZ2_bzReadOpen(&bzerror, r->fp, 0, 0, NULL, 0);
+	if (bzerror != BZ_OK) {
+		printf("mrt_reader_bz_open: BZ2_bzReadOpen failed: %d\n", bzerror);
+		fclose(r->fp);
+		return -1;
+	}
+	r->read = mrt_reader_bz_read;
+	r->close = mrt_reader_bz_close;
+	return 0;
+}
+
+/* 展開したデータをバッファに溜め、読み終えたレコードの分を詰めながら読む。 */
+static int
+mrt_rib_load_stream(struct mrt_reader *r, struct mrt_rib_loader *l)
+{
+	size_t size = MRT_STREAM_BUF_SIZE;
+	size_t fill = 0;
+	uint8_t *buf = malloc(size);
+	int ret = 0;
+
+	if (buf == NULL) {
+		printf("mrt_rib_load_stream: alloc failed\n");
+		return -1;
+	}
+	while (1) {
+		ssize_t n = r->read(r, buf + fill, size - fill);
+		if (n < 0) {
+			ret = -1;
+			break;
+		}
+		if (n == 0) {
+			if (fill != 0) {
+				printf("mrt_rib_load_stream: truncated record\n");
+				ret = -1;
+			}
+			break;
+		}
+		fill += n;
+		size_t off = mrt_rib_parse_records(buf, fill, l);
+		memmove(buf, buf + off, fill - off);
+		fill -= off;
+		if (fill == size) {
+			/* バッファより大きなレコード */
+			uint8_t *tmp = realloc(buf, size * 2);
+			if (tmp == NULL) {
+				printf("mrt_rib_load_stream: realloc failed\n");
+				ret = -1;
+				break;
+			}
+			buf = tmp;
+			size *= 2;
+		}
+	}
+	free(buf);
+	return ret;
+}
+
+/* ファイルを丸ごと mmap してレコードをコピーせずに読む。 */
+int
+mrt_rib_load_file(const char *path, struct mrt_rib_loader *l)
+{
+	struct stat statbuf;
+	uint8_t *addr;
+	size_t size;
+	size_t off;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("mrt_rib_load_file: open failed\n");
+		return -1;
+	}
+	if (fstat(fd, &statbuf) != 0) {
+		printf("mrt_rib_load_file: fstat failed\n");
+		close(fd);
+		return -1;
+	}
+	size = statbuf.st_size;
+	if (size == 0) {
+		close(fd);
+		return 0;
+	}
+	addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		printf("mrt_rib_load_file: mmap failed\n");
+		return -1;
+	}
+	if (size >= 3 && ((addr[0] == 0x1f && addr[1] == 0x8b) || memcmp(addr, "BZh", 3) == 0)) {
+		/* 先頭のマジックで圧縮形式を見分け、展開しながら読む。 */
+		struct mrt_reader r;
+		int ret;
+		int gz = (addr[0] == 0x1f);
+		munmap(addr, size);
+		memset(&r, 0, sizeof(r));
+		ret = gz ? mrt_reader_gz_open(&r, path) : mrt_reader_bz_open(&r, path);
+		if (ret != 0) {
+			return -1;
+		}
+		ret = mrt_rib_load_stream(&r, l);
+		r.close(&r);
+		return ret;
+	}
+	madvise(addr, size, MADV_SEQUENTIAL);
+	off = mrt_rib_parse_records(addr, size, l);
+	munmap(addr, size);
+	if (off != size) {
+		printf("mrt_rib_load_file: truncated record at %lu\n", off);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * n 個のアドレスの AS 番号をまとめて引き、見つからなければ 0 とする。 IPv4 は 4 つずつ
+ * rte_lpm_lookupx4 で、 IPv6 は rte_lpm6_lookup_bulk_func で引き、テーブルを読む待ち時間を重ねる。
+ * lcore_flow から呼ぶ。テーブルは RCU で守られているのでロックは取らない。
+ */
+void
+mrt_rib_lookup_bulk(struct dpdkflow_context *ctx, uint8_t af, uint8_t addrs[][16], uint32_t *as_nums, int n)
 {
-	uint32_t as_num;
-	int ret;
 	switch (af) {
 	case AF_IPV4:
 		{
-			rte_rwlock_read_lock(&ctx->mrt_rib_lock);
-			if (ctx->mrt_rib_table_ipv4 != NULL) {
-				uint32_t ip = ntohl(*(uint32_t *)&addr[12]);
-				ret = rte_lpm_lookup(ctx->mrt_rib_table_ipv4, ip, &as_num);
+			struct rte_lpm *lpm = __atomic_load_n(&ctx->mrt_rib_table_ipv4, __ATOMIC_ACQUIRE);
+			if (lpm == NULL) {
+				break;
 			}
-			rte_rwlock_read_unlock(&ctx->mrt_rib_lock);
-			if (ret == 0) {
-				return as_num;
+			for (int i = 0; i < n; i += 4) {
+				/* 4 つに満たない分は 0.0.0.0 を引いて捨てる。 */
+				uint32_t ips[4] = {0};
+				uint32_t hop[4];
+				for (int j = 0; j < 4 && i + j < n; j++) {
+					ips[j] = ntohl(*(uint32_t *)&addrs[i + j][12]);
+				}
+				rte_lpm_lookupx4(lpm, vect_loadu_sil128((xmm_t *)ips), hop, 0);
+				for (int j = 0; j < 4 && i + j < n; j++) {
+					as_nums[i + j] = hop[j];
+				}
 			}
 		}
-		break;
+		return;
 	case AF_IPV6:
 		{
-			rte_rwlock_read_lock(&ctx->mrt_rib_lock);
-			if (ctx->mrt_rib_table_ipv6 != NULL) {
-				ret = rte_lpm6_lookup(ctx->mrt_rib_table_ipv6, addr, &as_num);
+			struct rte_lpm6 *lpm6 = __atomic_load_n(&ctx->mrt_rib_table_ipv6, __ATOMIC_ACQUIRE);
+			int32_t next_hops[HOST_LOOKUP_MAX];
+			if (lpm6 == NULL || n > HOST_LOOKUP_MAX) {
+				break;
 			}
-			rte_rwlock_read_unlock(&ctx->mrt_rib_lock);
-			if (ret == 0) {
-				return as_num;
+			rte_lpm6_lookup_bulk_func(lpm6, addrs, next_hops, n);
+			for (int i = 0; i < n; i++) {
+				/* 見つからなければ -1 */
+				as_nums[i] = (next_hops[i] < 0) ? 0 : (uint32_t)next_hops[i];
 			}
 		}
-		break;
+		return;
 	}
-	return 0;
+	memset(as_nums, 0, sizeof(uint32_t) * n);
 }
 
 int
@@ -217,9 +578,6 @@ int
 mrt_rib_load(struct dpdkflow_context *ctx)
 {
 	int ret;
-	FILE *fp;
-	uint8_t buf[8192];
-	struct mrt_hdr mrt_hdr;
 	struct rte_lpm *new_lpm4 = NULL, *old_lpm4;
 	struct rte_lpm6 *new_lpm6 = NULL, *old_lpm6;
 	char new_lpm4_name[256];
@@ -235,8 +593,12 @@ mrt_rib_load(struct dpdkflow_context *ctx)
 		.flags = 0,
 	};
 	struct stat statbuf;
+	struct mrt_rib_loader loader = {0};
+	struct timespec beg, end;
+	double elapsed;
 
 	printf("mrt_rib_load: beg\n");
+	clock_gettime(CLOCK_MONOTONIC, &beg);
 
 	ret = stat(ctx->mrt_rib_path, &statbuf);
 	if (ret != 0) {
@@ -257,44 +619,25 @@ mrt_rib_load(struct dpdkflow_context *ctx)
 		goto failed_2;
 	}
 
-	fp = fopen(ctx->mrt_rib_path, "rb");
-	if (fp == NULL) {
-		printf("mrt_rib_load: fopen failed\n");
+	loader.lpm_ipv4 = new_lpm4;
+	loader.lpm_ipv6 = new_lpm6;
+	mrt_rib_loader_peers(&loader, ctx);
+	if (mrt_rib_load_file(ctx->mrt_rib_path, &loader) != 0) {
+		printf("mrt_rib_load: load failed\n");
 		goto failed_3;
 	}
-	while (1) {
-		ret = fread(&mrt_hdr, sizeof(struct mrt_hdr), 1, fp);
-		if (ret != 1) {
-			fclose(fp);
-			break;
-		}
-		mrt_hdr.timestamp = ntohl(mrt_hdr.timestamp);
-		mrt_hdr.type = ntohs(mrt_hdr.type);
-		mrt_hdr.subtype = ntohs(mrt_hdr.subtype);
-		mrt_hdr.length = ntohl(mrt_hdr.length);
-		if (mrt_hdr.length > 8192) {
-			printf("mrt_rib_load: too big\n");
-			goto failed_4;
-		}
-		ret = fread(buf, mrt_hdr.length, 1, fp);
-		if (ret != 1) {
-			printf("mrt_rib_load: buf read failed\n");
-			goto failed_4;
-		}
-		if (mrt_hdr.type == 13 && (mrt_hdr.subtype == 2 || mrt_hdr.subtype == 4)) {
-			parse_rib(buf, mrt_hdr.length, mrt_hdr.subtype, new_lpm4, new_lpm6);
-		}
-	}
 
-	rte_rwlock_write_lock(&ctx->mrt_rib_lock);
-	{
-		old_lpm4 = ctx->mrt_rib_table_ipv4;
-		ctx->mrt_rib_table_ipv4 = new_lpm4;
-		old_lpm6 = ctx->mrt_rib_table_ipv6;
-		ctx->mrt_rib_table_ipv6 = new_lpm6;
-		ctx->mrt_rib_last_mtim = statbuf.st_mtim;
-	}
-	rte_rwlock_write_unlock(&ctx->mrt_rib_lock);
+	old_lpm4 = ctx->mrt_rib_table_ipv4;
+	__atomic_store_n(&ctx->mrt_rib_table_ipv4, new_lpm4, __ATOMIC_RELEASE);
+	old_lpm6 = ctx->mrt_rib_table_ipv6;
+	__atomic_store_n(&ctx->mrt_rib_table_ipv6, new_lpm6, __ATOMIC_RELEASE);
+	ctx->mrt_rib_last_mtim = statbuf.st_mtim;
+	/* ダンプより新しい UPDATE のファイルを読み直す。 */
+	ctx->mrt_update_last_mtim = statbuf.st_mtim;
+	/* 古いテーブルから引いた host_cache を捨てさせる。 */
+	__atomic_add_fetch(&ctx->host_cache_generation, 1, __ATOMIC_RELEASE);
+	/* 古いテーブルを引いている lcore_flow がいなくなるまで待つ。 */
+	rte_rcu_qsbr_synchronize(ctx->rcu, RTE_QSBR_THRID_INVALID);
 
 	if (old_lpm4 != NULL) {
 		printf("mrt_rib_load: free old mrt rib table ipv4\n");
@@ -305,11 +648,17 @@ mrt_rib_load(struct dpdkflow_context *ctx)
 		rte_lpm6_free(old_lpm6);
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - beg.tv_sec) + (end.tv_nsec - beg.tv_nsec) / 1e9;
+	if (elapsed <= 0) {
+		elapsed = 1e-9;
+	}
+	printf("mrt_rib_load: %lu records %lu prefixes %.1f MB in %.2f sec (%.0f records/s %.1f MB/s)\n",
+			loader.records, loader.prefixes, loader.bytes / 1e6, elapsed,
+			loader.records / elapsed, loader.bytes / 1e6 / elapsed);
 	printf("mrt_rib_load: end\n");
 	return 0;
 
-failed_4:
-	fclose(fp);
 failed_3:
 	rte_lpm6_free(new_lpm6);
 failed_2:
@@ -327,8 +676,9 @@ mrt_rib_context_init(struct dpdkflow_context *ctx)
 	ctx->mrt_rib_table_ipv4_seq = 0;
 	ctx->mrt_rib_table_ipv6 = NULL;
 	ctx->mrt_rib_table_ipv6_seq = 0;
+	/* 0 は host_cache の空きを表すので 1 から始める。 */
+	ctx->host_cache_generation = 1;
 
-	rte_rwlock_init(&ctx->mrt_rib_lock);
 
 	mrt_rib_load(ctx);
 }
@@ -0,0 +1,473 @@
+#include "dpdkflow_cgo.h"
+
+#include <dirent.h>
+
+/*
+ * MRT の BGP4MP (type 16, 17) の UPDATE を読み、使用中の LPM に経路の追加と削除を反映する。
+ * ピアごとの経路は持たないので、 mrt_peers で選んだセッションの UPDATE だけを使う。
+ * 選んでいなければ最後に受け取った UPDATE で上書きし、どれか 1 つのピアが取り消せば消える。
+ */
+
+#define BGP4MP_MESSAGE 1
+#define BGP4MP_MESSAGE_AS4 4
+#define BGP4MP_MESSAGE_LOCAL 6
+#define BGP4MP_MESSAGE_AS4_LOCAL 7
+
+#define BGP_MARKER_LEN 16
+#define BGP_TYPE_UPDATE 2
+
+#define BGP_ATTR_AS_PATH 2
+#define BGP_ATTR_MP_REACH_NLRI 14
+#define BGP_ATTR_MP_UNREACH_NLRI 15
+#define BGP_ATTR_AS4_PATH 17
+
+#define BGP_AFI_IPV4 1
+#define BGP_AFI_IPV6 2
+#define BGP_SAFI_UNICAST 1
+
+/* 使用中のテーブルに反映するまでためておく UPDATE のプレフィクス。 as_num が 0 なら削除。 */
+struct mrt_update_op {
+	uint8_t prefix[16];
+	uint32_t as_num;
+	uint32_t seq;
+	uint16_t afi;
+	uint8_t prefix_len;
+};
+
+struct bgp_update_attrs {
+	uint8_t *as_path;
+	uint16_t as_path_len;
+	uint8_t *as4_path;
+	uint16_t as4_path_len;
+	uint8_t *mp_reach;
+	uint16_t mp_reach_len;
+	uint8_t *mp_unreach;
+	uint16_t mp_unreach_len;
+};
+
+static void
+mrt_update_table(struct mrt_rib_loader *l, uint16_t afi, uint8_t *prefix, uint8_t prefix_len, uint32_t as_num)
+{
+	if (afi == BGP_AFI_IPV4) {
+		if (as_num > 0) {
+			mrt_rib_table_add_ipv4(l->lpm_ipv4, prefix, prefix_len, as_num);
+		} else {
+			rte_lpm_delete(l->lpm_ipv4, ntohl(*(uint32_t *)prefix), prefix_len);
+		}
+	} else {
+		if (as_num > 0) {
+			mrt_rib_table_add_ipv6(l->lpm_ipv6, prefix, prefix_len, as_num);
+		} else {
+			rte_lpm6_delete(l->lpm_ipv6, prefix, prefix_len);
+		}
+	}
+}
+
+static void
+mrt_update_prefix(struct mrt_rib_loader *l, uint16_t afi, uint8_t *prefix, uint8_t prefix_len, uint32_t as_num)
+{
+	if (l->rcu == NULL) {
+		mrt_update_table(l, afi, prefix, prefix_len, as_num);
+	} else {
+		if (l->ops_num == l->ops_max) {
+			uint32_t max = l->ops_max ? l->ops_max * 2 : 4096;
+			struct mrt_update_op *tmp = realloc(l->ops, sizeof(struct mrt_update_op) * max);
+			if (tmp == NULL) {
+				printf("mrt_update_prefix: realloc failed\n");
+				return;
+			}
+			l->ops = tmp;
+			l->ops_max = max;
+		}
+		struct mrt_update_op *op = &l->ops[l->ops_num];
+		memcpy(op->prefix, prefix, 16);
+		op->as_num = as_num;
+		op->seq = l->ops_num++;
+		op->afi = afi;
+		op->prefix_len = prefix_len;
+	}
+	if (as_num > 0) {
+		l->prefixes++;
+	} else {
+		l->withdrawals++;
+	}
+}
+
+/* NLRI に並んだプレフィクスを as_num で追加する。 as_num が 0 なら削除する。 */
+static int
+mrt_update_nlri(struct mrt_rib_loader *l, uint16_t afi, uint8_t *buf, size_t len, uint32_t as_num)
+{
+	uint8_t *p = buf;
+	uint8_t *end = buf + len;
+	uint8_t max_len = (afi == BGP_AFI_IPV4) ? 32 : 128;
+	while (p < end) {
+		uint8_t prefix[16];
+		uint8_t prefix_len = *p++;
+		int array_len = (prefix_len + 7) >> 3;
+		if (prefix_len > max_len || p + array_len > end) {
+			printf("mrt_update_nlri: invalid data\n");
+			return -1;
+		}
+		memcpy(prefix, p, array_len);
+		memset(prefix + array_len, 0, 16 - array_len);
+		p += array_len;
+		mrt_update_prefix(l, afi, prefix, prefix_len, as_num);
+	}
+	return 0;
+}
+
+static int
+mrt_update_attrs(uint8_t *buf, size_t len, struct bgp_update_attrs *attrs)
+{
+	uint8_t *p = buf;
+	uint8_t *end = buf + len;
+	while (p < end) {
+		if (p + 3 > end) {
+			printf("mrt_update_attrs: invalid data (1)\n");
+			return -1;
+		}
+		uint8_t attr_flags = p[0];
+		uint8_t attr_type_code = p[1];
+		uint16_t attr_len;
+		p += 2;
+		if (attr_flags & 0x10) {
+			if (p + 2 > end) {
+				printf("mrt_update_attrs: invalid data (2)\n");
+				return -1;
+			}
+			attr_len = ntohs(*(uint16_t *)p);
+			p += 2;
+		} else {
+			attr_len = *p;
+			p += 1;
+		}
+		if (p + attr_len > end) {
+			printf("mrt_update_attrs: invalid data (3)\n");
+			return -1;
+		}
+		switch (attr_type_code) {
+		case BGP_ATTR_AS_PATH:
+			attrs->as_path = p;
+			attrs->as_path_len = attr_len;
+			break;
+		case BGP_ATTR_AS4_PATH:
+			attrs->as4_path = p;
+			attrs->as4_path_len = attr_len;
+			break;
+		case BGP_ATTR_MP_REACH_NLRI:
+			attrs->mp_reach = p;
+			attrs->mp_reach_len = attr_len;
+			break;
+		case BGP_ATTR_MP_UNREACH_NLRI:
+			attrs->mp_unreach = p;
+			attrs->mp_unreach_len = attr_len;
+			break;
+		}
+		p += attr_len;
+	}
+	return 0;
+}
+
+/* 2 バイト AS のセッションでは AS_PATH に AS_TRANS が入るので AS4_PATH があればそちらを使う。 */
+static uint32_t
+mrt_update_origin_as(struct bgp_update_attrs *attrs, int as_size)
+{
+	uint32_t as_num = 0;
+	if (as_size == 2 && attrs->as4_path != NULL) {
+		as_num = parse_as_path_attrs(attrs->as4_path, attrs->as4_path_len, 4);
+	}
+	if (as_num == 0 && attrs->as_path != NULL) {
+		as_num = parse_as_path_attrs(attrs->as_path, attrs->as_path_len, as_size);
+	}
+	return as_num;
+}
+
+static void
+mrt_update_message(struct mrt_rib_loader *l, uint8_t *buf, size_t len, int as_size)
+{
+	struct bgp_update_attrs attrs;
+	uint8_t *p = buf;
+	uint8_t *end = buf + len;
+	uint16_t withdrawn_len;
+	uint16_t attrs_len;
+	uint32_t as_num;
+
+	if (p + 2 > end) {
+		printf("mrt_update_message: invalid data (1)\n");
+		return;
+	}
+	withdrawn_len = ntohs(*(uint16_t *)p);
+	p += 2;
+	if (p + withdrawn_len + 2 > end) {
+		printf("mrt_update_message: invalid data (2)\n");
+		return;
+	}
+	uint8_t *withdrawn = p;
+	p += withdrawn_len;
+	attrs_len = ntohs(*(uint16_t *)p);
+	p += 2;
+	if (p + attrs_len > end) {
+		printf("mrt_update_message: invalid data (3)\n");
+		return;
+	}
+	memset(&attrs, 0, sizeof(attrs));
+	if (mrt_update_attrs(p, attrs_len, &attrs) != 0) {
+		return;
+	}
+	uint8_t *nlri = p + attrs_len;
+	as_num = mrt_update_origin_as(&attrs, as_size);
+
+	mrt_update_nlri(l, BGP_AFI_IPV4, withdrawn, withdrawn_len, 0);
+	if (attrs.mp_unreach != NULL && attrs.mp_unreach_len >= 3) {
+		uint16_t afi = ntohs(*(uint16_t *)attrs.mp_unreach);
+		uint8_t safi = attrs.mp_unreach[2];
+		if ((afi == BGP_AFI_IPV4 || afi == BGP_AFI_IPV6) && safi == BGP_SAFI_UNICAST) {
+			mrt_update_nlri(l, afi, attrs.mp_unreach + 3, attrs.mp_unreach_len - 3, 0);
+		}
+	}
+	if (as_num > 0) {
+		mrt_update_nlri(l, BGP_AFI_IPV4, nlri, end - nlri, as_num);
+		if (attrs.mp_reach != NULL && attrs.mp_reach_len >= 4) {
+			uint16_t afi = ntohs(*(uint16_t *)attrs.mp_reach);
+			uint8_t safi = attrs.mp_reach[2];
+			uint8_t nh_len = attrs.mp_reach[3];
+			/* AFI, SAFI, ネクストホップ長, ネクストホップ, 予約の 1 バイトのあとに NLRI */
+			int nlri_off = 4 + nh_len + 1;
+			if ((afi == BGP_AFI_IPV4 || afi == BGP_AFI_IPV6) && safi == BGP_SAFI_UNICAST
+			 && nlri_off <= attrs.mp_reach_len) {
+				mrt_update_nlri(l, afi, attrs.mp_reach + nlri_off, attrs.mp_reach_len - nlri_off, as_num);
+			}
+		}
+	}
+}
+
+/* BGP4MP のレコードから UPDATE を取り出して反映する。 */
+void
+mrt_update_parse(uint8_t *buf, size_t len, uint16_t type, uint16_t subtype, struct mrt_rib_loader *l)
+{
+	uint8_t *p = buf;
+	uint8_t *end = buf + len;
+	uint16_t afi;
+	uint16_t bgp_len;
+	int addr_len;
+	int as_size;
+
+	switch (subtype) {
+	case BGP4MP_MESSAGE:
+	case BGP4MP_MESSAGE_LOCAL:
+		as_size = 2;
+		break;
+	case BGP4MP_MESSAGE_AS4:
+	case BGP4MP_MESSAGE_AS4_LOCAL:
+		as_size = 4;
+		break;
+	default:
+		/* STATE_CHANGE など */
+		return;
+	}
+	if (type == 17) {
+		/* BGP4MP_ET はマイクロ秒の 4 バイトが先に付く */
+		p += 4;
+	}
+	/* ピア AS, ローカル AS, インターフェース番号, AFI */
+	p += as_size * 2 + 2;
+	if (p + 2 > end) {
+		printf("mrt_update_parse: invalid data (1)\n");
+		return;
+	}
+	afi = ntohs(*(uint16_t *)p);
+	p += 2;
+	/* ピアとローカルのアドレス */
+	addr_len = (afi == BGP_AFI_IPV6) ? 16 : 4;
+	if (p + addr_len * 2 + BGP_MARKER_LEN + 3 > end) {
+		printf("mrt_update_parse: invalid data (2)\n");
+		return;
+	}
+	if (!mrt_rib_peer_match(l, afi == BGP_AFI_IPV6, p)) {
+		return;
+	}
+	p += addr_len * 2;
+	p += BGP_MARKER_LEN;
+	bgp_len = ntohs(*(uint16_t *)p);
+	p += 2;
+	if (*p != BGP_TYPE_UPDATE) {
+		return;
+	}
+	p += 1;
+	if (bgp_len < BGP_MARKER_LEN + 3 || p + bgp_len - (BGP_MARKER_LEN + 3) > end) {
+		printf("mrt_update_parse: invalid data (3)\n");
+		return;
+	}
+	mrt_update_message(l, p, bgp_len - (BGP_MARKER_LEN + 3), as_size);
+}
+
+static int
+mrt_update_op_prefix_cmp(const struct mrt_update_op *a, const struct mrt_update_op *b)
+{
+	if (a->afi != b->afi) {
+		return (a->afi < b->afi) ? -1 : 1;
+	}
+	if (a->prefix_len != b->prefix_len) {
+		return (a->prefix_len < b->prefix_len) ? -1 : 1;
+	}
+	return memcmp(a->prefix, b->prefix, 16);
+}
+
+/* プレフィクスごとに受け取った順に並べる。 */
+static int
+mrt_update_op_cmp(const void *a, const void *b)
+{
+	const struct mrt_update_op *oa = a;
+	const struct mrt_update_op *ob = b;
+	int ret = mrt_update_op_prefix_cmp(oa, ob);
+	if (ret != 0) {
+		return ret;
+	}
+	return (oa->seq < ob->seq) ? -1 : 1;
+}
+
+/* そのプレフィクスについてファイルの中で最後に受け取ったものなら 1 を返す。 */
+static inline int
+mrt_update_op_last(struct mrt_rib_loader *l, uint32_t i)
+{
+	return i + 1 == l->ops_num || mrt_update_op_prefix_cmp(&l->ops[i], &l->ops[i + 1]) != 0;
+}
+
+/*
+ * ためておいた UPDATE を使用中のテーブルに反映する。プレフィクスごとに最後のものだけを使い、
+ * 削除をすべて済ませてから 1 度だけ RCU で待ち、追加する。削除で空いた tbl8 を追加で
+ * 使い回すのは、それを引いている途中の lcore_flow がいなくなってからになる。
+ */
+static void
+mrt_update_commit(struct mrt_rib_loader *l)
+{
+	int deleted = 0;
+	qsort(l->ops, l->ops_num, sizeof(struct mrt_update_op), mrt_update_op_cmp);
+	for (uint32_t i = 0; i < l->ops_num; i++) {
+		if (l->ops[i].as_num == 0 && mrt_update_op_last(l, i)) {
+			mrt_update_table(l, l->ops[i].afi, l->ops[i].prefix, l->ops[i].prefix_len, 0);
+			deleted = 1;
+		}
+	}
+	if (deleted) {
+		rte_rcu_qsbr_synchronize(l->rcu, RTE_QSBR_THRID_INVALID);
+	}
+	for (uint32_t i = 0; i < l->ops_num; i++) {
+		if (l->ops[i].as_num > 0 && mrt_update_op_last(l, i)) {
+			mrt_update_table(l, l->ops[i].afi, l->ops[i].prefix, l->ops[i].prefix_len, l->ops[i].as_num);
+		}
+	}
+}
+
+/*
+ * BGP4MP のファイルを ctx の使用中のテーブルに反映する。読めなかったときはテーブルに触れない。
+ */
+int
+mrt_update_load(struct dpdkflow_context *ctx, const char *path, struct mrt_rib_loader *l)
+{
+	int ret;
+	l->lpm_ipv4 = ctx->mrt_rib_table_ipv4;
+	l->lpm_ipv6 = ctx->mrt_rib_table_ipv6;
+	l->rcu = ctx->rcu;
+	mrt_rib_loader_peers(l, ctx);
+	ret = mrt_rib_load_file(path, l);
+	if (ret == 0 && l->rcu != NULL) {
+		mrt_update_commit(l);
+	}
+	free(l->ops);
+	l->ops = NULL;
+	l->ops_num = 0;
+	l->ops_max = 0;
+	return ret;
+}
+
+struct mrt_update_file {
+	char path[512];
+	struct timespec mtim;
+};
+
+static int
+mrt_update_file_cmp(const void *a, const void *b)
+{
+	const struct mrt_update_file *fa = a;
+	const struct mrt_update_file *fb = b;
+	if (fa->mtim.tv_sec != fb->mtim.tv_sec) {
+		return (fa->mtim.tv_sec < fb->mtim.tv_sec) ? -1 : 1;
+	}
+	if (fa->mtim.tv_nsec != fb->mtim.tv_nsec) {
+		return (fa->mtim.tv_nsec < fb->mtim.tv_nsec) ? -1 : 1;
+	}
+	return strcmp(fa->path, fb->path);
+}
+
+static int
+mrt_update_newer(struct timespec *a, struct timespec *b)
+{
+	return (a->tv_sec > b->tv_sec) || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+/*
+ * mrt_update_dir にあるファイルのうち、前回反映したものより新しいものを古い順に反映する。
+ * check_and_reload_tables から呼ぶ。 RIB をまだ読めていなければ何もしない。
+ */
+void
+mrt_update_apply(struct dpdkflow_context *ctx)
+{
+	struct mrt_update_file *files = NULL;
+	int files_num = 0;
+	int files_max = 0;
+	struct dirent *ent;
+	DIR *dir;
+
+	if (ctx->mrt_update_dir[0] == '\0'
+	 || ctx->mrt_rib_table_ipv4 == NULL || ctx->mrt_rib_table_ipv6 == NULL) {
+		return;
+	}
+	dir = opendir(ctx->mrt_update_dir);
+	if (dir == NULL) {
+		printf("mrt_update_apply: opendir failed\n");
+		return;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		struct mrt_update_file f;
+		struct stat statbuf;
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(f.path, sizeof(f.path), "%s/%s", ctx->mrt_update_dir, ent->d_name);
+		if (stat(f.path, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+			continue;
+		}
+		f.mtim = statbuf.st_mtim;
+		if (!mrt_update_newer(&f.mtim, &ctx->mrt_update_last_mtim)) {
+			continue;
+		}
+		if (files_num == files_max) {
+			int max = files_max ? files_max * 2 : 16;
+			struct mrt_update_file *tmp = realloc(files, sizeof(struct mrt_update_file) * max);
+			if (tmp == NULL) {
+				printf("mrt_update_apply: realloc failed\n");
+				break;
+			}
+			files = tmp;
+			files_max = max;
+		}
+		files[files_num++] = f;
+	}
+	closedir(dir);
+
+	qsort(files, files_num, sizeof(struct mrt_update_file), mrt_update_file_cmp);
+	for (int i = 0; i < files_num; i++) {
+		struct mrt_rib_loader loader = {0};
+		if (mrt_update_load(ctx, files[i].path, &loader) != 0) {
+			/* 書き込み途中かもしれないので次の呼び出しで読み直す。 */
+			printf("mrt_update_apply: load failed: %s\n", files[i].path);
+			break;
+		}
+		ctx->mrt_update_last_mtim = files[i].mtim;
+		__atomic_add_fetch(&ctx->host_cache_generation, 1, __ATOMIC_RELEASE);
+		printf("mrt_update_apply: %s: %lu records %lu announced %lu withdrawn\n",
+				files[i].path, loader.records, loader.prefixes, loader.withdrawals);
+	}
+	free(files);
+}
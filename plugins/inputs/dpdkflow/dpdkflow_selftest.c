@@ -0,0 +1,273 @@
+//go:build dpdkflow_selftest
+// +build dpdkflow_selftest
+
+#include "dpdkflow_cgo.h"
+
+#include <zlib.h>
+#include <bzlib.h>
+
+/*
+ * テスト用にポートへ UDP パケットを送り込む。
+ * net_ring の仮想デバイスは送信したパケットを同じポートの同じキューで受信する。
+ * 送信元アドレスを flows 通りに変えながら packets 個送り、送ったバイト数を返す。
+ */
+uint64_t
+selftest_inject(struct dpdkflow_context *ctx, uint16_t port, uint32_t packets, uint32_t flows)
+{
+	struct rte_mbuf *bufs[BURST_MAX];
+	uint16_t lens[BURST_MAX];
+	uint64_t bytes = 0;
+	uint32_t sent = 0;
+	while (sent < packets) {
+		int n = 0;
+		while (n < BURST_MAX && sent + n < packets) {
+			uint32_t seq = sent + n;
+			uint16_t payload_len = 18 + seq % 64;
+			uint16_t len = sizeof(struct rte_ether_hdr) + sizeof(struct rte_ipv4_hdr)
+					+ sizeof(struct rte_udp_hdr) + payload_len;
+			struct rte_mbuf *buf = rte_pktmbuf_alloc(ctx->mbuf_pool);
+			if (buf == NULL) {
+				break;
+			}
+			uint8_t *p = (uint8_t *)rte_pktmbuf_append(buf, len);
+			memset(p, 0, len);
+			struct rte_ether_hdr *eth_hdr = (struct rte_ether_hdr *)p;
+			eth_hdr->ether_type = rte_cpu_to_be_16(0x0800);
+			struct rte_ipv4_hdr *ipv4_hdr = (struct rte_ipv4_hdr *)(eth_hdr + 1);
+			ipv4_hdr->version_ihl = 0x45;
+			ipv4_hdr->total_length = rte_cpu_to_be_16(len - sizeof(struct rte_ether_hdr));
+			ipv4_hdr->time_to_live = 64;
+			ipv4_hdr->next_proto_id = IPPROTO_UDP;
+			ipv4_hdr->src_addr = rte_cpu_to_be_32(0x0a000000 | (seq % flows));
+			ipv4_hdr->dst_addr = rte_cpu_to_be_32(0xc0a80001);
+			ipv4_hdr->hdr_checksum = rte_ipv4_cksum(ipv4_hdr);
+			struct rte_udp_hdr *udp_hdr = (struct rte_udp_hdr *)(ipv4_hdr + 1);
+			udp_hdr->src_port = rte_cpu_to_be_16(10000 + seq % flows);
+			udp_hdr->dst_port = rte_cpu_to_be_16(53);
+			udp_hdr->dgram_len = rte_cpu_to_be_16(sizeof(struct rte_udp_hdr) + payload_len);
+			lens[n] = len;
+			bufs[n++] = buf;
+		}
+		int done = 0;
+		while (done < n) {
+			done += rte_eth_tx_burst(port, 0, &bufs[done], n - done);
+			if (__atomic_load_n(&ctx->done, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		for (int i = 0; i < done; i++) {
+			bytes += lens[i];
+		}
+		for (int i = done; i < n; i++) {
+			rte_pktmbuf_free(bufs[i]);
+		}
+		sent += done;
+		if (__atomic_load_n(&ctx->done, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	return bytes;
+}
+
+/*
+ * EAL を使わずに ipfix_export の書き出しだけを試す。
+ * af を集約しない設定で records 個のメトリックを IPv4 と IPv6 交互に作って書き出し、送れたレコード数を返す。
+ * キーは packet_to_metric と同じく、集約するものだけを入れる。
+ */
+int
+selftest_ipfix(const char *target, uint16_t mtu, uint32_t records)
+{
+	struct dpdkflow_context *ctx = calloc(1, sizeof(struct dpdkflow_context));
+	struct dpdkflow_metric m;
+	int sent;
+	if (ctx == NULL) {
+		return -1;
+	}
+	strcpy(ctx->ipfix_export, target);
+	ctx->ipfix_mtu = mtu;
+	ctx->aggregate_flags_incoming = aggregate_f_proto | aggregate_f_src_host | aggregate_f_dst_host
+			| aggregate_f_src_port | aggregate_f_dst_port;
+	if (ipfix_context_init(ctx) != 0 || ctx->ipfix == NULL) {
+		free(ctx);
+		return -1;
+	}
+	for (uint32_t i = 0; i < records; i++) {
+		metric_init(&m);
+		m.key.direction = DIRECTION_INCOMING;
+		if (aggregate_flags(ctx, m.key.direction) & aggregate_f_af) {
+			m.key.af = (i & 1) ? AF_IPV6 : AF_IPV4;
+		}
+		m.key.proto = 17;
+		if (i & 1) {
+			m.key.src_host[0] = 0x20;
+			m.key.src_host[1] = 0x01;
+		}
+		m.key.src_host[15] = i;
+		m.key.dst_host[15] = i >> 8;
+		m.key.src_port = 1024 + i;
+		m.key.dst_port = 53;
+		m.packets = 1;
+		m.bytes = 100;
+		ipfix_add(ctx->ipfix, &m);
+	}
+	ipfix_flush(ctx->ipfix);
+	sent = ctx->ipfix->records_sent;
+	ipfix_close(ctx);
+	free(ctx);
+	return sent;
+}
+
+/* テスト用に EAL を初期化する。 dpdkflow を起動しないテストの子プロセスで 1 度だけ呼ぶ。 */
+int
+selftest_eal_init(void)
+{
+	char *argv[] = { "dpdkflow_selftest", "-l", "0", "--no-huge", "-m", "256", "--no-pci" };
+	if (rte_eal_init(sizeof(argv) / sizeof(argv[0]), argv) < 0) {
+		printf("selftest_eal_init: rte_eal_init failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* clock_context_init で較正した時計だけを持つ ctx。 free で解放する。 */
+struct dpdkflow_context *
+selftest_clock_context(void)
+{
+	struct dpdkflow_context *ctx = calloc(1, sizeof(struct dpdkflow_context));
+	if (ctx == NULL) {
+		return NULL;
+	}
+	ctx->tsc1s = rte_get_tsc_hz();
+	clock_context_init(ctx);
+	return ctx;
+}
+
+/* 今の TSC と、それを C の側で壁時計に直した値を返す。 */
+uint64_t
+selftest_clock_now(struct dpdkflow_context *ctx, uint64_t *usec)
+{
+	uint64_t tsc = rte_rdtsc();
+	*usec = clock_tsc_to_usec(ctx, tsc);
+	return tsc;
+}
+
+void
+selftest_mrt_free(struct dpdkflow_context *ctx)
+{
+	if (ctx->mrt_rib_table_ipv4 != NULL) {
+		rte_lpm_free(ctx->mrt_rib_table_ipv4);
+	}
+	if (ctx->mrt_rib_table_ipv6 != NULL) {
+		rte_lpm6_free(ctx->mrt_rib_table_ipv6);
+	}
+	rte_free(ctx->rcu);
+	free(ctx);
+}
+
+/*
+ * mrt_update_load を試すための空の AS 番号のテーブル。 mrt_rib_load よりずっと小さく作る。
+ * RCU に登録する lcore_flow はいないので、 rte_rcu_qsbr_synchronize はすぐに返る。
+ */
+struct dpdkflow_context *
+selftest_mrt_context(void)
+{
+	static int seq = 0;
+	struct rte_lpm_config lpm4_config = {
+		.max_rules = 1024,
+		.number_tbl8s = (1 << 8),
+		.flags = 0,
+	};
+	struct rte_lpm6_config lpm6_config = {
+		.max_rules = 1024,
+		.number_tbl8s = (1 << 10),
+		.flags = 0,
+	};
+	char name[32];
+	struct dpdkflow_context *ctx = calloc(1, sizeof(struct dpdkflow_context));
+	if (ctx == NULL) {
+		return NULL;
+	}
+	snprintf(name, sizeof(name), "selftest_ipv4_%d", seq);
+	ctx->mrt_rib_table_ipv4 = rte_lpm_create(name, rte_socket_id(), &lpm4_config);
+	snprintf(name, sizeof(name), "selftest_ipv6_%d", seq++);
+	ctx->mrt_rib_table_ipv6 = rte_lpm6_create(name, rte_socket_id(), &lpm6_config);
+	if (ctx->mrt_rib_table_ipv4 == NULL || ctx->mrt_rib_table_ipv6 == NULL) {
+		printf("selftest_mrt_context: lpm create failed\n");
+		selftest_mrt_free(ctx);
+		return NULL;
+	}
+	ctx->rcu = rte_zmalloc("selftest_rcu", rte_rcu_qsbr_get_memsize(1), RTE_CACHE_LINE_SIZE);
+	if (ctx->rcu == NULL || rte_rcu_qsbr_init(ctx->rcu, 1) != 0) {
+		printf("selftest_mrt_context: rcu init failed\n");
+		selftest_mrt_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/* path を mrt_update_dir のファイルと同じように ctx の使用中のテーブルに反映する。 */
+int
+selftest_mrt_load(struct dpdkflow_context *ctx, const char *path)
+{
+	struct mrt_rib_loader loader = {0};
+	return mrt_update_load(ctx, path, &loader);
+}
+
+void
+selftest_mrt_lookup(struct dpdkflow_context *ctx, uint8_t af, uint8_t *addrs, uint32_t *as_nums, int n)
+{
+	mrt_rib_lookup_bulk(ctx, af, (uint8_t (*)[16])addrs, as_nums, n);
+}
+
+/* src を gzip か bzip2 で圧縮して dst に書く。 mrt_rib_load_file の展開を試すのに使う。 */
+int
+selftest_compress(const char *src, const char *dst, int bz2)
+{
+	uint8_t buf[65536];
+	size_t n;
+	int ret = 0;
+	FILE *in = fopen(src, "rb");
+	if (in == NULL) {
+		return -1;
+	}
+	if (bz2) {
+		int err;
+		FILE *out = fopen(dst, "wb");
+		BZFILE *b = (out == NULL) ? NULL : BZ2_bzWriteOpen(&err, out, 9, 0, 0);
+		if (b == NULL) {
+			ret = -1;
+		} else {
+			while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+				BZ2_bzWrite(&err, b, buf, n);
+				if (err != BZ_OK) {
+					ret = -1;
+					break;
+				}
+			}
+			BZ2_bzWriteClose(&err, b, 0, NULL, NULL);
+			if (err != BZ_OK) {
+				ret = -1;
+			}
+		}
+		if (out != NULL && fclose(out) != 0) {
+			ret = -1;
+		}
+	} else {
+		gzFile g = gzopen(dst, "wb");
+		if (g == NULL) {
+			ret = -1;
+		} else {
+			while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+				if (gzwrite(g, buf, n) != (int)n) {
+					ret = -1;
+					break;
+				}
+			}
+			if (gzclose(g) != Z_OK) {
+				ret = -1;
+			}
+		}
+	}
+	fclose(in);
+	return ret;
+}
@@ -0,0 +1,155 @@
+//go:build dpdkflow_selftest
+// +build dpdkflow_selftest
+
+package dpdkflow
+
+// #include "dpdkflow_cgo.h"
+// #include <stdlib.h>
+// extern uint64_t selftest_inject(struct dpdkflow_context *ctx, uint16_t port, uint32_t packets, uint32_t flows);
+// extern int selftest_ipfix(const char *target, uint16_t mtu, uint32_t records);
+// extern int selftest_eal_init(void);
+// extern struct dpdkflow_context *selftest_clock_context(void);
+// extern uint64_t selftest_clock_now(struct dpdkflow_context *ctx, uint64_t *usec);
+// extern struct dpdkflow_context *selftest_mrt_context(void);
+// extern void selftest_mrt_free(struct dpdkflow_context *ctx);
+// extern int selftest_mrt_load(struct dpdkflow_context *ctx, const char *path);
+// extern void selftest_mrt_lookup(struct dpdkflow_context *ctx, uint8_t af, uint8_t *addrs, uint32_t *as_nums, int n);
+// extern int selftest_compress(const char *src, const char *dst, int bz2);
+import "C"
+
+import (
+	"errors"
+	"net"
+	"unsafe"
+)
+
+func (df *DpdkFlow) selftestRunning() bool {
+	return df.ctx != nil && C.int(df.ctx.running) == 1
+}
+
+func (df *DpdkFlow) selftestInject(port int, packets int, flows int) uint64 {
+	return uint64(C.selftest_inject(df.ctx, C.uint16_t(port), C.uint32_t(packets), C.uint32_t(flows)))
+}
+
+func (df *DpdkFlow) selftestStats() (alloced uint64, getfailed uint64) {
+	var sum C.struct_dpdkflow_stats
+	C.stats_sum(df.ctx, &sum)
+	return uint64(sum.metric_alloced), uint64(sum.metric_getfailed)
+}
+
+func selftestIpfix(export string, mtu int, records int) (int, error) {
+	target, err := ipfixTarget(export)
+	if err != nil {
+		return 0, err
+	}
+	ctarget := C.CString(target)
+	defer C.free(unsafe.Pointer(ctarget))
+	return int(C.selftest_ipfix(ctarget, C.uint16_t(mtu), C.uint32_t(records))), nil
+}
+
+func selftestEalInit() error {
+	if C.selftest_eal_init() != 0 {
+		return errors.New("selftest_eal_init failed")
+	}
+	return nil
+}
+
+// clock_context_init で較正した時計だけを持つ DpdkFlow。
+func newSelftestClock() (*DpdkFlow, error) {
+	ctx := C.selftest_clock_context()
+	if ctx == nil {
+		return nil, errors.New("selftest_clock_context failed")
+	}
+	return &DpdkFlow{ctx: ctx}, nil
+}
+
+func (df *DpdkFlow) selftestClockFree() {
+	C.free(unsafe.Pointer(df.ctx))
+}
+
+func (df *DpdkFlow) selftestClockCalibrate() {
+	C.clock_calibrate(df.ctx)
+}
+
+// 今の TSC と、それを C の clock_tsc_to_usec で直した値を返す。
+func (df *DpdkFlow) selftestClockNow() (tsc uint64, usec uint64) {
+	var cusec C.uint64_t
+	tsc = uint64(C.selftest_clock_now(df.ctx, &cusec))
+	return tsc, uint64(cusec)
+}
+
+// mrt_update_load と mrt_rib_lookup_bulk を EAL の上で直接試すためのテーブル。
+type selftestMrt struct {
+	ctx *C.struct_dpdkflow_context
+}
+
+func newSelftestMrt() (*selftestMrt, error) {
+	ctx := C.selftest_mrt_context()
+	if ctx == nil {
+		return nil, errors.New("selftest_mrt_context failed")
+	}
+	return &selftestMrt{ctx: ctx}, nil
+}
+
+func (m *selftestMrt) free() {
+	C.selftest_mrt_free(m.ctx)
+}
+
+// 次の load から mrt_peers で選んだセッションの経路だけを使う。
+func (m *selftestMrt) setPeers(peers []string) error {
+	ipv4, ipv6, err := mrtPeers(peers)
+	if err != nil {
+		return err
+	}
+	setMrtPeers(m.ctx, ipv4, ipv6)
+	return nil
+}
+
+func (m *selftestMrt) load(path string) error {
+	cpath := C.CString(path)
+	defer C.free(unsafe.Pointer(cpath))
+	if C.selftest_mrt_load(m.ctx, cpath) != 0 {
+		return errors.New("mrt_update_load failed: " + path)
+	}
+	return nil
+}
+
+// IPv4 と IPv6 のアドレスを混ぜて渡してよい。 AF ごとにまとめて引く。
+func (m *selftestMrt) lookup(ips []net.IP) []uint32 {
+	asNums := make([]uint32, len(ips))
+	for _, af := range []C.uint8_t{C.AF_IPV4, C.AF_IPV6} {
+		var index []int
+		var addrs []byte
+		for i, ip := range ips {
+			if (ip.To4() != nil) == (af == C.AF_IPV4) {
+				index = append(index, i)
+				addrs = append(addrs, ip.To16()...)
+			}
+		}
+		if len(index) == 0 {
+			continue
+		}
+		found := make([]uint32, len(index))
+		C.selftest_mrt_lookup(m.ctx, af, (*C.uint8_t)(unsafe.Pointer(&addrs[0])),
+			(*C.uint32_t)(unsafe.Pointer(&found[0])), C.int(len(index)))
+		for j, i := range index {
+			asNums[i] = found[j]
+		}
+	}
+	return asNums
+}
+
+func selftestCompress(src string, dst string, bz2 bool) error {
+	csrc := C.CString(src)
+	defer C.free(unsafe.Pointer(csrc))
+	cdst := C.CString(dst)
+	defer C.free(unsafe.Pointer(cdst))
+	b := C.int(0)
+	if bz2 {
+		b = 1
+	}
+	if C.selftest_compress(csrc, cdst, b) != 0 {
+		return errors.New("selftest_compress failed: " + dst)
+	}
+	return nil
+}
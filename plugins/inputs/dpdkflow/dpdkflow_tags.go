@@ -0,0 +1,183 @@
+package dpdkflow
+
+import (
+	"net"
+	"strconv"
+)
+
+// キャッシュがこの数を超えたら作り直す。
+const tagCacheMax = 1 << 20
+
+// 集約方向ごとに出力するタグ。 Start で aggregate_* から作っておく。
+type tagSchema struct {
+	iface   bool
+	af      bool
+	proto   bool
+	vlan    bool
+	srcHost bool
+	dstHost bool
+	srcAs   bool
+	dstAs   bool
+	srcPort bool
+	dstPort bool
+	app     bool
+}
+
+// C の degrade_flags と同じく、段階に応じて集約キーを粗くする。
+func degradeFlags(flags uint32, degrade int) uint32 {
+	if degrade >= degradePorts && flags&(aggregateFSrcPort|aggregateFDstPort) != 0 {
+		flags &^= aggregateFSrcPort | aggregateFDstPort
+		flags |= aggregateFApp
+	}
+	if degrade >= degradeNoHost {
+		flags &^= aggregateFSrcHost | aggregateFDstHost
+	}
+	return flags
+}
+
+func newTagSchema(flags uint32) tagSchema {
+	return tagSchema{
+		iface:   flags&aggregateFIface != 0,
+		af:      flags&aggregateFAf != 0,
+		proto:   flags&aggregateFProto != 0,
+		vlan:    flags&aggregateFVlan != 0,
+		srcHost: flags&aggregateFSrcHost != 0,
+		dstHost: flags&aggregateFDstHost != 0,
+		srcAs:   flags&aggregateFSrcAs != 0,
+		dstAs:   flags&aggregateFDstAs != 0,
+		srcPort: flags&aggregateFSrcPort != 0,
+		dstPort: flags&aggregateFDstPort != 0,
+		app:     flags&aggregateFApp != 0,
+	}
+}
+
+// 同じ値のタグ文字列を使い回すためのキャッシュ。 gather_batch からしか触らない。
+type tagCache struct {
+	ifaces   map[int8]string
+	protos   [256]string
+	vlans    map[int32]string
+	asns     map[uint32]string
+	ports    map[int32]string
+	apps     map[uint32]string
+	appDescs map[uint32]string
+	hosts    map[[16]byte]string
+	buf      []byte
+}
+
+func newTagCache(ifaces map[int8]string) *tagCache {
+	c := &tagCache{ifaces: ifaces}
+	for i := range c.protos {
+		c.protos[i] = strconv.Itoa(i)
+	}
+	c.reset()
+	return c
+}
+
+func (c *tagCache) reset() {
+	c.vlans = make(map[int32]string)
+	c.asns = make(map[uint32]string)
+	c.ports = make(map[int32]string)
+	c.apps = make(map[uint32]string)
+	c.appDescs = make(map[uint32]string)
+	c.hosts = make(map[[16]byte]string)
+}
+
+// 大きくなりすぎていたら捨てる。バッチの最初に呼ぶ。
+func (c *tagCache) trim() {
+	if len(c.hosts)+len(c.asns)+len(c.ports)+len(c.vlans)+len(c.apps)+len(c.appDescs) > tagCacheMax {
+		c.reset()
+	}
+}
+
+func (c *tagCache) iface(iface int8) string {
+	if s, ok := c.ifaces[iface]; ok {
+		return s
+	}
+	return "unknown"
+}
+
+func (c *tagCache) proto(proto uint8) string {
+	return c.protos[proto]
+}
+
+// 段階は小さな数なので proto と同じ表を使う。
+func (c *tagCache) degrade(degrade int) string {
+	return c.protos[degrade]
+}
+
+func (c *tagCache) vlan(vlan int32) string {
+	s, ok := c.vlans[vlan]
+	if !ok {
+		s = strconv.FormatInt(int64(vlan), 10)
+		c.vlans[vlan] = s
+	}
+	return s
+}
+
+func (c *tagCache) asn(asn uint32) string {
+	s, ok := c.asns[asn]
+	if !ok {
+		s = strconv.FormatUint(uint64(asn), 10)
+		c.asns[asn] = s
+	}
+	return s
+}
+
+func (c *tagCache) port(port int32) string {
+	s, ok := c.ports[port]
+	if !ok {
+		s = strconv.FormatInt(int64(port), 10)
+		c.ports[port] = s
+	}
+	return s
+}
+
+func (c *tagCache) app(app uint32) string {
+	s, ok := c.apps[app]
+	if !ok {
+		c.buf = c.buf[:0]
+		for shift := 28; shift >= 0; shift -= 4 {
+			c.buf = append(c.buf, "0123456789abcdef"[(app>>uint(shift))&0xf])
+		}
+		s = string(c.buf)
+		c.apps[app] = s
+	}
+	return s
+}
+
+// app_desc は app_table の再読み込みで変わりうるので中身も比べる。
+func (c *tagCache) appDesc(app uint32, desc []byte) string {
+	s, ok := c.appDescs[app]
+	if !ok || s != string(desc) {
+		s = string(desc)
+		c.appDescs[app] = s
+	}
+	return s
+}
+
+func (c *tagCache) host(addr *[16]byte) string {
+	s, ok := c.hosts[*addr]
+	if !ok {
+		s = c.formatHost(addr)
+		c.hosts[*addr] = s
+	}
+	return s
+}
+
+func (c *tagCache) formatHost(ba *[16]byte) string {
+	for i := 0; i < 12; i++ {
+		if ba[i] != 0 {
+			/* IPv6 */
+			return net.IP(ba[:]).String()
+		}
+	}
+	/* IPv4 */
+	c.buf = c.buf[:0]
+	for i := 12; i < 16; i++ {
+		if i > 12 {
+			c.buf = append(c.buf, '.')
+		}
+		c.buf = strconv.AppendUint(c.buf, uint64(ba[i]), 10)
+	}
+	return string(c.buf)
+}
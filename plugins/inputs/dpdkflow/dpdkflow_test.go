@@ -0,0 +1,492 @@
+//go:build dpdkflow_selftest
+// +build dpdkflow_selftest
+
+package dpdkflow
+
+import (
+	"encoding/binary"
+	"net"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"regexp"
+	"runtime"
+	"strings"
+	"sync"
+	"testing"
+	"time"
+
+	"github.com/influxdata/telegraf/testutil"
+	"github.com/stretchr/testify/require"
+)
+
+// EAL を使うテストを子プロセスで動かすときに、どのテストかを渡す環境変数。
+const ealTestEnv = "DPDKFLOW_EAL_TEST"
+
+// DPDK の EAL は 1 プロセスで 1 度しか初期化できないので、 EAL を使うテストは
+// テストのバイナリを子プロセスとして動かし直し、そのテストだけを走らせる。
+// 子プロセスの中なら true を返すので、呼んだテストはそのまま続ける。
+func ealChild(t *testing.T) bool {
+	switch os.Getenv(ealTestEnv) {
+	case t.Name():
+		return true
+	case "":
+	default:
+		t.Skip("another test uses EAL in this process")
+	}
+	parts := strings.Split(t.Name(), "/")
+	for i := range parts {
+		parts[i] = "^" + regexp.QuoteMeta(parts[i]) + "$"
+	}
+	cmd := exec.Command(os.Args[0], "-test.run="+strings.Join(parts, "/"), "-test.v")
+	cmd.Env = append(os.Environ(), ealTestEnv+"="+t.Name())
+	out, err := cmd.CombinedOutput()
+	require.NoError(t, err, string(out))
+	return false
+}
+
+// 2 つの lcore_flow に net_ring のポートを 1 つずつ受け持たせ、
+// 同じフローのパケットを同時に送り込んで合計がずれないことを確かめる。
+// metrics_num が足りてフローのデータを割り当てられる場合と、足りずにあふれ用のデータに
+// 足し込む場合の両方を試す。
+// go test -tags dpdkflow_selftest ./plugins/inputs/dpdkflow
+func TestStressTotals(t *testing.T) {
+	if runtime.NumCPU() < 3 {
+		t.Skip("needs at least 3 cpus")
+	}
+	cases := []struct {
+		name       string
+		metricsNum uint32
+		overflow   bool
+	}{
+		{"fit", 65536, false},
+		// 2 つの lcore_flow に 1000 フローずつ来るので 1024 では足りない。
+		{"overflow", 1024, true},
+	}
+	for _, tc := range cases {
+		tc := tc
+		t.Run(tc.name, func(t *testing.T) {
+			if ealChild(t) {
+				stressTotals(t, tc.metricsNum, tc.overflow)
+			}
+		})
+	}
+}
+
+func stressTotals(t *testing.T, metricsNum uint32, overflow bool) {
+	const packets = 1000000
+	const flows = 1000
+
+	df := NewDpdkFlow()
+	df.MainCoreIndex = 0
+	df.Interval = 1
+	df.MetricsNum = metricsNum
+	df.AggregateExternal = []string{"af", "proto", "src_host", "src_port"}
+	df.EalArgs = []string{"--no-huge", "-m", "1024", "--no-pci", "--vdev=net_ring0", "--vdev=net_ring1"}
+	df.Cores = []DpdkFlowCore{
+		{Index: 1, Ports: []DpdkFlowPort{{Index: 0, Description: "ring0"}}},
+		{Index: 2, Ports: []DpdkFlowPort{{Index: 1, Description: "ring1"}}},
+	}
+	require.NoError(t, df.Init())
+
+	var acc testutil.Accumulator
+	require.NoError(t, df.Start(&acc))
+	defer df.Stop()
+
+	deadline := time.Now().Add(60 * time.Second)
+	for !df.selftestRunning() {
+		if time.Now().After(deadline) {
+			t.Fatal("dpdkflow did not start")
+		}
+		time.Sleep(100 * time.Millisecond)
+	}
+
+	var wg sync.WaitGroup
+	var bytes [2]uint64
+	for port := 0; port < 2; port++ {
+		wg.Add(1)
+		go func(port int) {
+			defer wg.Done()
+			bytes[port] = df.selftestInject(port, packets, flows)
+		}(port)
+	}
+	wg.Wait()
+	wantPackets := uint64(2 * packets)
+	wantBytes := bytes[0] + bytes[1]
+
+	var gotPackets, gotBytes, overflowPackets uint64
+	for time.Now().Before(deadline) {
+		gotPackets, gotBytes, overflowPackets = 0, 0, 0
+		acc.Lock()
+		for _, m := range acc.Metrics {
+			gotPackets += m.Fields["packets"].(uint64)
+			gotBytes += m.Fields["bytes"].(uint64)
+			if m.Tags["overflow"] == "true" {
+				overflowPackets += m.Fields["packets"].(uint64)
+			}
+		}
+		acc.Unlock()
+		if gotPackets >= wantPackets {
+			break
+		}
+		time.Sleep(100 * time.Millisecond)
+	}
+	_, getfailed := df.selftestStats()
+	if overflow {
+		require.NotEqual(t, uint64(0), getfailed)
+		require.NotEqual(t, uint64(0), overflowPackets)
+	} else {
+		require.Equal(t, uint64(0), getfailed)
+		require.Equal(t, uint64(0), overflowPackets)
+	}
+	require.Equal(t, wantPackets, gotPackets)
+	require.Equal(t, wantBytes, gotBytes)
+}
+
+// ipfix_export で UDP に送った IPFIX メッセージを受け取り、
+// ヘッダ、テンプレートセット、データレコードの数を確かめる。 EAL は使わない。
+// af を集約しなくても IPv6 のフローは IPv6 のテンプレートで、アドレスを切らずに送られること。
+func TestIpfixExportUdp(t *testing.T) {
+	const records = 1000
+	const mtu = 1400
+
+	conn, err := net.ListenUDP("udp", &net.UDPAddr{IP: net.IPv4(127, 0, 0, 1)})
+	require.NoError(t, err)
+	defer conn.Close()
+
+	sent, err := selftestIpfix("udp://"+conn.LocalAddr().String(), mtu, records)
+	require.NoError(t, err)
+	require.Equal(t, records, sent)
+
+	templates := make(map[uint16]int)
+	dataRecords := 0
+	ipv6Records := 0
+	sequence := uint32(0)
+	buf := make([]byte, 65536)
+	for dataRecords < records {
+		require.NoError(t, conn.SetReadDeadline(time.Now().Add(5*time.Second)))
+		n, _, err := conn.ReadFromUDP(buf)
+		require.NoError(t, err)
+		require.LessOrEqual(t, n, mtu)
+		msg := buf[:n]
+		require.Equal(t, uint16(10), binary.BigEndian.Uint16(msg[0:2]))
+		require.Equal(t, uint16(n), binary.BigEndian.Uint16(msg[2:4]))
+		require.Equal(t, sequence, binary.BigEndian.Uint32(msg[8:12]))
+		msgRecords := 0
+		for off := 16; off < n; {
+			setID := binary.BigEndian.Uint16(msg[off : off+2])
+			setLen := int(binary.BigEndian.Uint16(msg[off+2 : off+4]))
+			require.True(t, setLen >= 4 && off+setLen <= n)
+			set := msg[off+4 : off+setLen]
+			if setID == 2 {
+				for p := 0; p < len(set); {
+					id := binary.BigEndian.Uint16(set[p : p+2])
+					count := int(binary.BigEndian.Uint16(set[p+2 : p+4]))
+					length := 0
+					for i := 0; i < count; i++ {
+						length += int(binary.BigEndian.Uint16(set[p+4+i*4+2 : p+4+i*4+4]))
+					}
+					templates[id] = length
+					p += 4 + count*4
+				}
+			} else {
+				length, ok := templates[setID]
+				require.True(t, ok, "data set %d before template", setID)
+				require.Equal(t, 0, len(set)%length)
+				msgRecords += len(set) / length
+				if setID == 257 {
+					// sourceIPv6Address が先頭に来る。 selftest_ipfix は 2001::<i> を入れる。
+					for p := 0; p < len(set); p += length {
+						require.Equal(t, []byte{0x20, 0x01}, set[p:p+2])
+						require.Equal(t, byte(1), set[p+15]&1)
+						ipv6Records++
+					}
+				}
+			}
+			off += setLen
+		}
+		dataRecords += msgRecords
+		sequence += uint32(msgRecords)
+	}
+	require.Contains(t, templates, uint16(256))
+	require.Contains(t, templates, uint16(257))
+	require.Equal(t, records, dataRecords)
+	require.Equal(t, records/2, ipv6Records)
+}
+
+// Go に写し取った TSC から壁時計への変換が、較正の前後とも C の clock_tsc_to_usec と
+// 同じ値を返し、壁時計から大きくずれないことを確かめる。
+func TestClockMapping(t *testing.T) {
+	if !ealChild(t) {
+		return
+	}
+	require.NoError(t, selftestEalInit())
+	df, err := newSelftestClock()
+	require.NoError(t, err)
+	defer df.selftestClockFree()
+
+	for i := 0; i < 3; i++ {
+		tsc, usec := df.selftestClockNow()
+		m := df.clockMapping()
+		require.Equal(t, usec, m.usec(tsc))
+		require.WithinDuration(t, time.Now(), m.time(tsc), 100*time.Millisecond)
+		// 較正より前の TSC は較正した時刻に丸める。
+		require.Equal(t, m.usecBase, m.usec(m.tscBase-1))
+		time.Sleep(10 * time.Millisecond)
+		df.selftestClockCalibrate()
+	}
+}
+
+// TABLE_DUMP_V2 のダンプと BGP4MP の UPDATE を手で組み立てて mrt_rib_load_file に読ませ、
+// AS 番号のテーブルに広告と取り消しが反映されることを確かめる。 mrt_peers を指定したときは
+// ほかのピアの経路と UPDATE を使わないことも確かめる。展開しながら読む gzip と bzip2 でも同じことを試す。
+func TestMrtUpdate(t *testing.T) {
+	if !ealChild(t) {
+		return
+	}
+	require.NoError(t, selftestEalInit())
+
+	// 選ぶピアの IPv4 と IPv6 のセッションと、選ばないピア
+	peerIpv4 := "192.0.2.254"
+	peerIpv6 := "2001:db8::fe"
+	other := "192.0.2.253"
+
+	dir := t.TempDir()
+	rib := filepath.Join(dir, "rib.mrt")
+	announce := filepath.Join(dir, "announce.mrt")
+	withdraw := filepath.Join(dir, "withdraw.mrt")
+	var buf []byte
+	// 203.0.113.0/24 はどちらのピアからも届いていて、選ばないピアが先に並ぶ。
+	buf = append(buf, peerIndexTable(other, peerIpv4, peerIpv6)...)
+	buf = append(buf, ribIpv4Unicast("203.0.113.0/24",
+		ribEntry(0, asPath(4, 64513, 65010)), ribEntry(1, asPath(4, 64512, 65011)))...)
+	require.NoError(t, os.WriteFile(rib, buf, 0644))
+
+	buf = nil
+	// 4 バイト AS のセッションで IPv4 の 2 つのプレフィクスを広告する。
+	buf = append(buf, bgp4mpRecord(false, 4, peerIpv4, bgpUpdate(nil,
+		bgpAttr(0x40, 2, asPath(4, 64512, 4200000001, 65002)),
+		bgpPrefix("192.0.2.0/24"), bgpPrefix("198.51.100.0/24")))...)
+	// 2 バイト AS のセッションの BGP4MP_ET で IPv6 のプレフィクスを MP_REACH_NLRI で広告する。
+	// AS_PATH には AS_TRANS が入るので AS4_PATH の最後の AS 番号を使う。
+	buf = append(buf, bgp4mpRecord(true, 1, peerIpv6, bgpUpdate(nil,
+		append(append(bgpAttr(0x40, 2, asPath(2, 64512, 23456)),
+			bgpAttr(0xc0, 17, asPath(4, 64512, 65003))...),
+			bgpAttr(0x80, 14, mpReach("2001:db8:1::/48"))...), nil))...)
+	require.NoError(t, os.WriteFile(announce, buf, 0644))
+
+	buf = nil
+	// 192.0.2.0/24 を取り消す。
+	buf = append(buf, bgp4mpRecord(false, 4, peerIpv4, bgpUpdate(bgpPrefix("192.0.2.0/24"), nil, nil))...)
+	// 2001:db8:1::/48 を MP_UNREACH_NLRI で取り消す。
+	buf = append(buf, bgp4mpRecord(false, 4, peerIpv6, bgpUpdate(nil,
+		bgpAttr(0x80, 15, mpUnreach("2001:db8:1::/48")), nil))...)
+	// 同じファイルの中では最後に受け取ったものが残る。 2001:db8:2::/48 は広告してから取り消し、
+	// 100.64.0.0/10 は取り消してから広告する。
+	buf = append(buf, bgp4mpRecord(false, 4, peerIpv6, bgpUpdate(nil,
+		append(bgpAttr(0x40, 2, asPath(4, 64512, 65006)),
+			bgpAttr(0x80, 14, mpReach("2001:db8:2::/48"))...), nil))...)
+	buf = append(buf, bgp4mpRecord(false, 4, peerIpv4, bgpUpdate(bgpPrefix("100.64.0.0/10"), nil, nil))...)
+	buf = append(buf, bgp4mpRecord(false, 4, peerIpv6, bgpUpdate(nil,
+		bgpAttr(0x80, 15, mpUnreach("2001:db8:2::/48")), nil))...)
+	buf = append(buf, bgp4mpRecord(false, 4, peerIpv4, bgpUpdate(nil,
+		bgpAttr(0x40, 2, asPath(4, 64512, 65005)), bgpPrefix("100.64.0.0/10")))...)
+	// 選ばないピアが 198.51.100.0/24 を取り消し、 203.0.113.0/24 を別の AS で広告する。
+	buf = append(buf, bgp4mpRecord(false, 4, other, bgpUpdate(bgpPrefix("198.51.100.0/24"),
+		bgpAttr(0x40, 2, asPath(4, 64513, 65004)), bgpPrefix("203.0.113.0/24")))...)
+	require.NoError(t, os.WriteFile(withdraw, buf, 0644))
+
+	ips := []net.IP{
+		net.ParseIP("192.0.2.1"),
+		net.ParseIP("198.51.100.1"),
+		net.ParseIP("2001:db8:1::1"),
+		net.ParseIP("203.0.113.1"),
+		net.ParseIP("2001:db8:2::1"),
+		net.ParseIP("100.64.0.1"),
+	}
+	raw := func(path string) string { return path }
+	selected := [][]uint32{
+		{0, 0, 0, 65011, 0, 0},
+		{65002, 65002, 65003, 65011, 0, 0},
+		{0, 65002, 0, 65011, 0, 65005},
+	}
+	cases := []struct {
+		name     string
+		peers    []string
+		compress func(path string) string
+		want     [][]uint32
+	}{
+		{"raw", []string{peerIpv4, peerIpv6}, raw, selected},
+		{"gzip", []string{peerIpv4, peerIpv6}, func(path string) string {
+			require.NoError(t, selftestCompress(path, path+".gz", false))
+			return path + ".gz"
+		}, selected},
+		{"bzip2", []string{peerIpv4, peerIpv6}, func(path string) string {
+			require.NoError(t, selftestCompress(path, path+".bz2", true))
+			return path + ".bz2"
+		}, selected},
+		// mrt_peers がなければダンプは最初のピアの経路を使い、どのピアの UPDATE でも上書きする。
+		{"all_peers", nil, raw, [][]uint32{
+			{0, 0, 0, 65010, 0, 0},
+			{65002, 65002, 65003, 65010, 0, 0},
+			{0, 0, 0, 65004, 0, 65005},
+		}},
+	}
+	for _, tc := range cases {
+		tc := tc
+		t.Run(tc.name, func(t *testing.T) {
+			m, err := newSelftestMrt()
+			require.NoError(t, err)
+			defer m.free()
+			require.NoError(t, m.setPeers(tc.peers))
+			for i, path := range []string{rib, announce, withdraw} {
+				require.NoError(t, m.load(tc.compress(path)))
+				require.Equal(t, tc.want[i], m.lookup(ips), path)
+			}
+		})
+	}
+}
+
+// MRT のレコードにした、 peer から受け取った BGP4MP の UPDATE 。 as4 でないセッションは AS 番号が 2 バイト。
+func bgp4mpRecord(et bool, subtype uint16, peer string, update []byte) []byte {
+	asSize := 2
+	if subtype == 4 {
+		asSize = 4
+	}
+	var body []byte
+	if et {
+		body = append(body, 0, 0, 0, 0)
+	}
+	body = append(body, make([]byte, asSize*2+2)...)
+	ip := net.ParseIP(peer)
+	if ip.To4() == nil {
+		body = append(body, 0, 2)
+		body = append(body, ip.To16()...)
+		body = append(body, make([]byte, 16)...)
+	} else {
+		body = append(body, 0, 1)
+		body = append(body, ip.To4()...)
+		body = append(body, make([]byte, 4)...)
+	}
+	for i := 0; i < 16; i++ {
+		body = append(body, 0xff)
+	}
+	body = appendUint16(body, uint16(19+len(update)))
+	body = append(body, 2)
+	body = append(body, update...)
+
+	typ := uint16(16)
+	if et {
+		typ = 17
+	}
+	return mrtRecord(typ, subtype, body)
+}
+
+func mrtRecord(typ uint16, subtype uint16, body []byte) []byte {
+	rec := make([]byte, 12)
+	binary.BigEndian.PutUint16(rec[4:6], typ)
+	binary.BigEndian.PutUint16(rec[6:8], subtype)
+	binary.BigEndian.PutUint32(rec[8:12], uint32(len(body)))
+	return append(rec, body...)
+}
+
+// TABLE_DUMP_V2 の PEER_INDEX_TABLE 。ピアの番号は peers の並び順。 AS 番号は使わないので 0 にする。
+func peerIndexTable(peers ...string) []byte {
+	body := make([]byte, 4)
+	body = appendUint16(body, 0)
+	body = appendUint16(body, uint16(len(peers)))
+	for _, peer := range peers {
+		ip := net.ParseIP(peer)
+		if ip.To4() == nil {
+			body = append(body, 0x03)
+			body = append(body, make([]byte, 4)...)
+			body = append(body, ip.To16()...)
+		} else {
+			body = append(body, 0x02)
+			body = append(body, make([]byte, 4)...)
+			body = append(body, ip.To4()...)
+		}
+		body = appendUint32(body, 0)
+	}
+	return mrtRecord(13, 1, body)
+}
+
+// TABLE_DUMP_V2 の RIB_IPV4_UNICAST 。
+func ribIpv4Unicast(cidr string, entries ...[]byte) []byte {
+	body := make([]byte, 4)
+	body = append(body, bgpPrefix(cidr)...)
+	body = appendUint16(body, uint16(len(entries)))
+	for _, e := range entries {
+		body = append(body, e...)
+	}
+	return mrtRecord(13, 2, body)
+}
+
+// peerIndex のピアから届いた、 AS_PATH だけを持つ RIB のエントリ。
+func ribEntry(peerIndex uint16, path []byte) []byte {
+	var b []byte
+	b = appendUint16(b, peerIndex)
+	b = appendUint32(b, 0)
+	attr := bgpAttr(0x40, 2, path)
+	b = appendUint16(b, uint16(len(attr)))
+	return append(b, attr...)
+}
+
+func bgpUpdate(withdrawn []byte, attrs []byte, nlri ...[]byte) []byte {
+	var b []byte
+	b = appendUint16(b, uint16(len(withdrawn)))
+	b = append(b, withdrawn...)
+	b = appendUint16(b, uint16(len(attrs)))
+	b = append(b, attrs...)
+	for _, n := range nlri {
+		b = append(b, n...)
+	}
+	return b
+}
+
+// IPv6 ユニキャストの cidr を広告する MP_REACH_NLRI の中身。
+func mpReach(cidr string) []byte {
+	b := []byte{0, 2, 1, 16}
+	b = append(b, net.ParseIP("2001:db8::1")...)
+	b = append(b, 0)
+	return append(b, bgpPrefix(cidr)...)
+}
+
+// IPv6 ユニキャストの cidr を取り消す MP_UNREACH_NLRI の中身。
+func mpUnreach(cidr string) []byte {
+	return append([]byte{0, 2, 1}, bgpPrefix(cidr)...)
+}
+
+func bgpAttr(flags byte, code byte, data []byte) []byte {
+	return append([]byte{flags, code, byte(len(data))}, data...)
+}
+
+// AS_SEQUENCE が 1 つだけの AS_PATH 。
+func asPath(asSize int, ases ...uint32) []byte {
+	b := []byte{2, byte(len(ases))}
+	for _, as := range ases {
+		if asSize == 2 {
+			b = appendUint16(b, uint16(as))
+		} else {
+			b = appendUint32(b, as)
+		}
+	}
+	return b
+}
+
+func bgpPrefix(cidr string) []byte {
+	_, ipnet, err := net.ParseCIDR(cidr)
+	if err != nil {
+		panic(err)
+	}
+	plen, _ := ipnet.Mask.Size()
+	return append([]byte{byte(plen)}, ipnet.IP[:(plen+7)/8]...)
+}
+
+func appendUint16(b []byte, v uint16) []byte {
+	return append(b, byte(v>>8), byte(v))
+}
+
+func appendUint32(b []byte, v uint32) []byte {
+	return append(b, byte(v>>24), byte(v>>16), byte(v>>8), byte(v))
+}
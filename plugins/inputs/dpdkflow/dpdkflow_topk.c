@@ -0,0 +1,222 @@
+#include "dpdkflow_cgo.h"
+
+/*
+ * topk モード。方向ごとに space-saving のカウンタを topk * TOPK_CAPACITY_FACTOR 個だけ持ち、
+ * バイト数の多いフローを追いかける。カウンタが埋まっているときは最小のものを新しいキーに譲り、
+ * その値を誤差(packets_error, bytes_error)として引き継ぐ。
+ * カウンタはバイト数の最小ヒープで並べておく。
+ */
+
+static inline int
+topk_less(struct dpdkflow_topk *t, uint32_t a, uint32_t b)
+{
+	return t->entries[t->heap[a]].metric.bytes < t->entries[t->heap[b]].metric.bytes;
+}
+
+static inline void
+topk_swap(struct dpdkflow_topk *t, uint32_t a, uint32_t b)
+{
+	uint32_t tmp = t->heap[a];
+	t->heap[a] = t->heap[b];
+	t->heap[b] = tmp;
+	t->entries[t->heap[a]].heap_index = a;
+	t->entries[t->heap[b]].heap_index = b;
+}
+
+static inline void
+topk_sift_up(struct dpdkflow_topk *t, uint32_t i)
+{
+	while (i > 0) {
+		uint32_t parent = (i - 1) / 2;
+		if (!topk_less(t, i, parent)) {
+			break;
+		}
+		topk_swap(t, i, parent);
+		i = parent;
+	}
+}
+
+static inline void
+topk_sift_down(struct dpdkflow_topk *t, uint32_t i)
+{
+	for (;;) {
+		uint32_t l = i * 2 + 1;
+		uint32_t r = l + 1;
+		uint32_t smallest = i;
+		if (l < t->num && topk_less(t, l, smallest)) {
+			smallest = l;
+		}
+		if (r < t->num && topk_less(t, r, smallest)) {
+			smallest = r;
+		}
+		if (smallest == i) {
+			break;
+		}
+		topk_swap(t, i, smallest);
+		i = smallest;
+	}
+}
+
+void
+topk_update(struct dpdkflow_context *ctx, struct dpdkflow_metric_shard *shard,
+		struct dpdkflow_metric *m, uint32_t hash)
+{
+	struct dpdkflow_topk *t = &shard->topk[shard->metric_epoch & 1][m->key.direction];
+	struct dpdkflow_topk_entry *e;
+
+	e = (struct dpdkflow_topk_entry *)metric_table_lookup(&t->table, m, hash);
+	if (e != NULL) {
+		e->metric.packets += m->packets;
+		e->metric.bytes += m->bytes;
+		topk_sift_down(t, e->heap_index);
+		return;
+	}
+
+	/*
+	 * テーブルに入らなかったカウンタは次のパケットで見つからず、同じキーのカウンタが重複してしまう。
+	 * 入らなかったときはカウンタを作らずにパケットを捨て、テーブルの insert_failed に数える。
+	 */
+	if (t->num < t->capacity) {
+		e = &t->entries[t->num];
+		e->metric = *m;
+		e->hash = hash;
+		if (metric_table_insert(&t->table, &e->metric, hash) != 0) {
+			return;
+		}
+		e->heap_index = t->num;
+		t->heap[t->num] = t->num;
+		t->num++;
+		topk_sift_up(t, e->heap_index);
+	} else {
+		e = &t->entries[t->heap[0]];
+		struct dpdkflow_topk_entry evicted = *e;
+		metric_table_remove(&t->table, &e->metric, e->hash);
+		e->metric = *m;
+		e->metric.packets += evicted.metric.packets;
+		e->metric.bytes += evicted.metric.bytes;
+		e->metric.packets_error = evicted.metric.packets;
+		e->metric.bytes_error = evicted.metric.bytes;
+		e->hash = hash;
+		if (metric_table_insert(&t->table, &e->metric, hash) != 0) {
+			/* 追い出したカウンタを戻す。空いたばかりの場所に入るので失敗しない。 */
+			*e = evicted;
+			metric_table_insert(&t->table, &e->metric, e->hash);
+			return;
+		}
+		topk_sift_down(t, 0);
+	}
+	if (aggregate_flag_up(ctx, e->metric.key.direction, aggregate_f_app)) {
+		fill_app_desc(e->metric.app_desc, e->metric.key.app, ctx);
+	}
+}
+
+static int
+topk_compare(const void *a, const void *b)
+{
+	const struct dpdkflow_metric *ma = *(struct dpdkflow_metric * const *)a;
+	const struct dpdkflow_metric *mb = *(struct dpdkflow_metric * const *)b;
+	if (ma->bytes > mb->bytes) {
+		return -1;
+	}
+	if (ma->bytes < mb->bytes) {
+		return 1;
+	}
+	return 0;
+}
+
+static struct dpdkflow_metric *
+topk_find(struct dpdkflow_metric **candidates, uint32_t n, struct dpdkflow_metric *m)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		if (metric_key_equals(&candidates[i]->key, &m->key)) {
+			return candidates[i];
+		}
+	}
+	return NULL;
+}
+
+/* 直前のエポックのカウンタを lcore_flow をまたいでまとめ、方向ごとに上位 topk 個を吐き出す。 */
+void
+topk_drain(struct dpdkflow_context *ctx)
+{
+	uint32_t old = (ctx->metric_epoch - 1) & 1;
+	if (ctx->topk == 0) {
+		return;
+	}
+	for (int d = DIRECTION_INCOMING; d < DIRECTION_NUM; d++) {
+		uint32_t n = 0;
+		/* まとめるテーブルに入らなかったキーがあれば、それからあとは候補を順に探してまとめる。 */
+		int linear = 0;
+		for (int i = 0; i < ctx->core_num; i++) {
+			struct dpdkflow_topk *t = &ctx->metric_shards[i].topk[old][d];
+			for (uint32_t j = 0; j < t->num; j++) {
+				struct dpdkflow_metric *m = &t->entries[j].metric;
+				struct dpdkflow_metric *tmp;
+				tmp = metric_table_lookup(&ctx->metric_merge_table, m, t->entries[j].hash);
+				if (tmp == NULL && linear) {
+					tmp = topk_find(ctx->topk_candidates, n, m);
+				}
+				if (tmp != NULL) {
+					metric_merge(tmp, m);
+					continue;
+				}
+				if (!linear && metric_table_insert(&ctx->metric_merge_table, m, t->entries[j].hash) != 0) {
+					linear = 1;
+				}
+				ctx->topk_candidates[n++] = m;
+			}
+		}
+		qsort(ctx->topk_candidates, n, sizeof(struct dpdkflow_metric *), topk_compare);
+		for (uint32_t j = 0; j < n && j < ctx->topk; j++) {
+			ctx->topk_candidates[j]->stop_time = ctx->metric_epoch_start;
+			metric_export_record(ctx, ctx->topk_candidates[j]);
+		}
+		metric_table_reset(&ctx->metric_merge_table);
+		for (int i = 0; i < ctx->core_num; i++) {
+			struct dpdkflow_topk *t = &ctx->metric_shards[i].topk[old][d];
+			metric_table_reset(&t->table);
+			t->num = 0;
+		}
+	}
+}
+
+int
+topk_context_init(struct dpdkflow_context *ctx)
+{
+	uint32_t capacity = ctx->topk * TOPK_CAPACITY_FACTOR;
+
+	printf("topk_context_init\n");
+
+	if (ctx->topk == 0) {
+		return 0;
+	}
+	for (int i = 0; i < ctx->core_num; i++) {
+		for (int e = 0; e < 2; e++) {
+			for (int d = DIRECTION_INCOMING; d < DIRECTION_NUM; d++) {
+				struct dpdkflow_topk *t = &ctx->metric_shards[i].topk[e][d];
+				char name[32];
+				snprintf(name, sizeof(name), "topk_%d_%d_%d", i, e, d);
+				t->entries = rte_zmalloc(name, sizeof(struct dpdkflow_topk_entry) * capacity,
+						RTE_CACHE_LINE_SIZE);
+				t->heap = rte_zmalloc(name, sizeof(uint32_t) * capacity, RTE_CACHE_LINE_SIZE);
+				if (t->entries == NULL || t->heap == NULL) {
+					printf("topk_context_init: %s alloc failed\n", name);
+					return -1;
+				}
+				/* 追い出しに失敗しないようにテーブルには余裕を持たせる。 */
+				if (metric_table_init(&t->table, name, capacity * 2) != 0) {
+					return -1;
+				}
+				t->num = 0;
+				t->capacity = capacity;
+			}
+		}
+	}
+	ctx->topk_candidates = rte_zmalloc("topk_candidates",
+			sizeof(struct dpdkflow_metric *) * capacity * ctx->core_num, RTE_CACHE_LINE_SIZE);
+	if (ctx->topk_candidates == NULL) {
+		printf("topk_context_init: topk_candidates alloc failed\n");
+		return -1;
+	}
+	return 0;
+}